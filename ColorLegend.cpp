@@ -0,0 +1,134 @@
+#include "ColorLegend.h"
+
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const int    g_legendLutBits = 5;
+static const int    g_legendLutSize = 1 << g_legendLutBits;
+static const int    g_legendCellShift = 8 - g_legendLutBits;
+static const int    g_legendCellSide = 1 << g_legendCellShift;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int GetCellID( const int colR, const int colG, const int colB )
+{
+    return ( ( ( colR >> g_legendCellShift ) * g_legendLutSize ) + ( colG >> g_legendCellShift ) ) * g_legendLutSize +
+           ( colB >> g_legendCellShift );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CColorLegend::CColorLegend() :
+    m_tolerance( 0 )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CColorLegend::AddStop( const uint8_t colR, const uint8_t colG, const uint8_t colB, const float value )
+{
+    assert( m_stop.size() < 0xFFFF );
+    SStop stop;
+    stop.col[0] = colR;
+    stop.col[1] = colG;
+    stop.col[2] = colB;
+    stop.value = value;
+    m_stop.push_back( stop );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CColorLegend::SetTolerance( const int tolerance )
+{
+    m_tolerance = std::max( 0, tolerance );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CColorLegend::Build()
+{
+    const int cellCount = g_legendLutSize * g_legendLutSize * g_legendLutSize;
+    const int stopCount = static_cast< int >( m_stop.size() );
+    m_cellStart.assign( cellCount + 1, 0 );
+    m_candidate.clear();
+    if( 0 == stopCount )
+        return;
+    
+    // Stop is a candidate of the cell if its nearest point of the cell box is not farther than
+    // the farthest point of the box from some other stop
+    std::vector< int > minDist( stopCount );
+    for( int i = 0; i < cellCount; ++i )
+    {
+        const int cellCol[3] = { i / ( g_legendLutSize * g_legendLutSize ), ( i / g_legendLutSize ) % g_legendLutSize, i % g_legendLutSize };
+        int bound = INT32_MAX;
+        for( int s = 0; s < stopCount; ++s )
+        {
+            int nearDist = 0;
+            int farDist = 0;
+            for( int c = 0; c < 3; ++c )
+            {
+                const int lo = cellCol[c] << g_legendCellShift;
+                const int hi = lo + g_legendCellSide - 1;
+                const int col = m_stop[s].col[c];
+                const int nearDelta = ( col < lo ) ? ( lo - col ) : ( ( col > hi ) ? ( col - hi ) : 0 );
+                const int farDelta = std::max( col - lo, hi - col );
+                nearDist += nearDelta * nearDelta;
+                farDist += farDelta * farDelta;
+            }
+            minDist[s] = nearDist;
+            bound = std::min( bound, farDist );
+        }
+        
+        for( int s = 0; s < stopCount; ++s )
+            if( minDist[s] <= bound )
+                m_candidate.push_back( static_cast< uint16_t >( s ) );
+        m_cellStart[i + 1] = static_cast< uint32_t >( m_candidate.size() );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CColorLegend::GetValue( const uint8_t colR, const uint8_t colG, const uint8_t colB, float *pValue ) const
+{
+    assert( pValue );
+    if( m_cellStart.empty() )
+        return false;
+    
+    const int cellID = GetCellID( colR, colG, colB );
+    const uint32_t candidateEnd = m_cellStart[cellID + 1];
+    int bestDist = INT32_MAX;
+    int bestStop = -1;
+    for( uint32_t i = m_cellStart[cellID]; i < candidateEnd; ++i )
+    {
+        const SStop& stop = m_stop[m_candidate[i]];
+        const int deltaR = stop.col[0] - colR;
+        const int deltaG = stop.col[1] - colG;
+        const int deltaB = stop.col[2] - colB;
+        const int dist = deltaR * deltaR + deltaG * deltaG + deltaB * deltaB;
+        if( dist < bestDist )
+        {
+            bestDist = dist;
+            bestStop = m_candidate[i];
+        }
+    }
+    
+    assert( bestStop >= 0 );
+    if( m_tolerance > 0 && bestDist > m_tolerance * m_tolerance )
+        return false;
+    
+    *pValue = m_stop[bestStop].value;
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CColorLegend::GetStopCount() const
+{
+    return static_cast< int >( m_stop.size() );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t CColorLegend::GetHash() const
+{
+    // FNV-1a of stops and tolerance
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for( size_t i = 0; i < m_stop.size(); ++i )
+    {
+        uint32_t valueBits = 0;
+        memcpy( &valueBits, &m_stop[i].value, sizeof( valueBits ) );
+        const uint64_t word = ( static_cast< uint64_t >( m_stop[i].col[0] ) << 48 ) |
+                              ( static_cast< uint64_t >( m_stop[i].col[1] ) << 40 ) |
+                              ( static_cast< uint64_t >( m_stop[i].col[2] ) << 32 ) | valueBits;
+        hash = ( hash ^ word ) * prime;
+    }
+    
+    return ( hash ^ static_cast< uint64_t >( m_tolerance ) ) * prime;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,45 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  ColorLegend.h
+//  GeoData
+//
+//  Class CColorLegend: inverse mapping of colour-ramped maps from RGB to value
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstdint>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Legend is a list of colour stops with their values. Colour is mapped to the value of the
+// nearest stop. RGB cube is split into cells of 5 bits per channel and every cell keeps
+// only the stops which may be the nearest for some colour of the cell, so a lookup compares the
+// colour with one or a few stops.
+class CColorLegend
+{
+public:
+    CColorLegend();
+
+    void        AddStop( const uint8_t colR, const uint8_t colG, const uint8_t colB, const float value );
+    void        SetTolerance( const int tolerance );
+    void        Build();
+
+    // Returns false if the nearest stop is farther than the tolerance
+    bool        GetValue( const uint8_t colR, const uint8_t colG, const uint8_t colB, float *pValue ) const;
+    int         GetStopCount() const;
+    uint64_t    GetHash() const;
+
+private:
+
+    struct SStop
+    {
+        int     col[3];
+        float   value;
+    };
+
+    std::vector< SStop >        m_stop;
+    std::vector< uint32_t >     m_cellStart;
+    std::vector< uint16_t >     m_candidate;
+    int                         m_tolerance;    // Max RGB distance to the nearest stop, 0 - any
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
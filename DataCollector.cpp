@@ -1,13 +1,25 @@
 #include "DataCollector.h"
 
 #include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
 #include <iostream>
-#include <thread>
 #include <mutex>
+#include <chrono>
+#include <map>
+#include <fstream>
 
 #include "TerraData.h"
+#include "GeometryData.h"
+#include "PixelCoverage.h"
+#include "ThreadPool.h"
+#include "ColorLegend.h"
+#include "RasterCache.h"
+#include "RawRaster.h"
+#include "Profiler.h"
+#include "Utils.h"
 #include "tinyXML/tinyXML.h"
-#include "jpeg/jpgd.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 static const char  *g_pCollectRoot = "collect";
@@ -19,18 +31,188 @@ static const char  *g_pAttrDataType = "dataType";
 static const char  *g_pAttrRangeMin = "rangeMin";
 static const char  *g_pAttrRangeMax = "rangeMax";
 static const char  *g_pAttrMonth = "month";
+static const char  *g_pAttrSampling = "sampling";
+static const char  *g_pAttrHash = "hash";
+static const char  *g_pAttrLegend = "legend";
+static const char  *g_pAttrLegendHash = "legendHash";
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const char  *g_pAttrWidth = "width";
+static const char  *g_pAttrHeight = "height";
+static const char  *g_pAttrHeaderSize = "headerSize";
+static const char  *g_pAttrByteOrder = "byteOrder";
+static const char  *g_pAttrNoData = "nodata";
+static const char  *g_pByteOrderBig = "big";
+static const char  *g_pByteOrderLittle = "little";
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const char  *g_pItemTile = "tile";
+static const char  *g_pAttrLonMin = "lonMin";
+static const char  *g_pAttrLonMax = "lonMax";
+static const char  *g_pAttrLatMin = "latMin";
+static const char  *g_pAttrLatMax = "latMax";
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const char  *g_pItemBand = "band";
+static const char  *g_pAttrChannel = "channel";
+static const char  *g_pChannelStr = "rgb";
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const char  *g_pCollectLegend = "legend";
+static const char  *g_pLegendStop = "stop";
+static const char  *g_pAttrName = "name";
+static const char  *g_pAttrTolerance = "tolerance";
+static const char  *g_pAttrColor = "color";
+static const char  *g_pAttrValue = "value";
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const char  *g_pManifestRoot = "manifest";
+static const char  *g_pAttrVersion = "version";
+static const char  *g_pAttrCellCount = "cellCount";
+static const int    g_manifestVersion = 1;  // Increase when sampling changes its results
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const int    g_jobPerCore = 4;       // Cell jobs per image for every core
+static const int    g_minJobCellCount = 4096;
+static const int    g_jobCellAlign = 64;    // Keeps range bounds off shared cache lines and validity words
+static const int    g_minCellPixelCount = 4; // Pixels per cell at the equator kept by scaled decoding
+static const int    g_maxDecodeScaleShift = 3;
+static const int    g_tileBinCountLon = 360; // One degree bins of the tile index
+static const int    g_tileBinCountLat = 180;
+static const int    g_readTaskCount = 2;    // Read tasks mostly wait for storage
+static const int    g_queueSizePerTask = 2; // Items a stage may queue for every task of the next one
+static const int    g_maxBandCount = 3;     // Bands of a packed image, one per channel
+static const int    g_kernelBlockCellCount = 256; // Cells written by all kernels of a job before the next ones
+static const int    g_maxBatchSourceCount = 36; // Day, night and sea temperature of every month
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::STile::STile() :
+    lonMin( 0.0f ),
+    lonMax( 0.0f ),
+    latMin( 0.0f ),
+    latMax( 0.0f ),
+    fileHash( 0 )
+{}
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 CDataCollector::SImageData::SImageData() :
+    samplingMode( SAMPLING_MODE_NEAREST ),
     rangeMin( FLT_MAX ),
     rangeMax( -FLT_MAX ),
     month( -1 ),
-    bWasStarted( false )
+    channel( 0 ),
+    bandCount( 1 ),
+    legendID( -1 ),
+    legendHash( 0 ),
+    rawSizeX( 0 ),
+    rawSizeY( 0 ),
+    rawHeaderSize( 0 ),
+    bIsBigEndian( false ),
+    bHasNoData( false ),
+    noData( 0.0f ),
+    bIsTiled( false ),
+    fileHash( 0 ),
+    bIsChanged( true ),
+    bIsFailed( false )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::SPixelMap::SPixelMap( const int _sizeX, const int _sizeY ) :
+    sizeX( _sizeX ),
+    sizeY( _sizeY )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::SAreaMap::SAreaMap( const int _sizeX, const int _sizeY ) :
+    sizeX( _sizeX ),
+    sizeY( _sizeY )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::SSource::SSource( const int _imageID, const int _tileID ) :
+    imageID( _imageID ),
+    tileID( _tileID ),
+    jobBegin( 0 ),
+    jobEnd( 0 ),
+    decodeSize( 0 ),
+    cellSize( 0 ),
+    sizeX( 0 ),
+    sizeY( 0 ),
+    bIsFailed( false ),
+    jobLeft( 0 )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::SCellJob::SCellJob( const int _sourceID, const int _sourceCount, const int _rangeID,
+                                    const int _cellBegin, const int _cellEnd ) :
+    sourceID( _sourceID ),
+    sourceCount( _sourceCount ),
+    rangeID( _rangeID ),
+    cellBegin( _cellBegin ),
+    cellEnd( _cellEnd )
 {}
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::SRangeTicket::SRangeTicket() :
+    done( 0 )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::SMemoryBudget::SMemoryBudget( const size_t _limit ) :
+    limit( _limit ),
+    used( 0 ),
+    peak( 0 ),
+    waitCount( 0 ),
+    heldBackID( -1 )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::SStageStats::SStageStats() :
+    taskCount( 0 ),
+    busyTimeUS( 0 )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::SPipeline::SPipeline( const int sourceCount, const int jobCount, const int rangeCount,
+                                      const size_t memoryLimit ) :
+    nextAdmit( 0 ),
+    nextRelease( 0 ),
+    bIsDecoded( sourceCount, false ),
+    jobLeft( jobCount ),
+    budget( memoryLimit ),
+    ticket( rangeCount )
+{
+    for( int i = 0; i < STAGE_COUNT; ++i )
+        taskCount[i] = 0;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t GetTimeUS()
+{
+    const std::chrono::steady_clock::duration time = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast< std::chrono::microseconds >( time ).count();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Largest JPEG downscale 1 / 2^shift which still leaves g_minCellPixelCount pixels per cell.
+// Equirectangular pixels are the largest at the equator, where a cell covers
+// 2 * sizeX * sizeY / ( PI * cellCount ) pixels.
+static int CalcDecodeScaleShift( const int sizeX, const int sizeY, const int cellCount )
+{
+    const double equatorPixelCount = 2.0 * sizeX * sizeY / ( 3.1415926 * cellCount );
+    int shift = 0;
+    while( shift < g_maxDecodeScaleShift &&
+           equatorPixelCount / ( 1 << ( 2 * ( shift + 1 ) ) ) >= g_minCellPixelCount )
+        ++shift;
+    
+    return shift;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Tile is decoded at the scale it would have as a part of a global image
+static int CalcTileScaleShift( const int sizeX, const int sizeY, const float lonSpan, const float latSpan,
+                               const int cellCount )
+{
+    const int globalSizeX = static_cast< int >( sizeX * 360.0f / lonSpan );
+    const int globalSizeY = static_cast< int >( sizeY * 180.0f / latSpan );
+    return CalcDecodeScaleShift( globalSizeX, globalSizeY, cellCount );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t GetFileHash( std::map< std::string, uint64_t >& fileHash, const std::string& filename )
+{
+    std::map< std::string, uint64_t >::const_iterator it = fileHash.find( filename );
+    if( it == fileHash.end() )
+        it = fileHash.insert( std::make_pair( filename, CalcFileHash( filename.c_str() ) ) ).first;
+    return it->second;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 const char *CDataCollector::m_pImageTypeStr[IMAGE_TYPE_COUNT] =
 {
     "grayScale",
-    "color"
+    "color",
+    "rawInt16",
+    "rawFloat32"
 };
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 const char *CDataCollector::m_pDataTypeStr[DATA_TYPE_COUNT] =
@@ -43,20 +225,176 @@ const char *CDataCollector::m_pDataTypeStr[DATA_TYPE_COUNT] =
     "temperatureSea"
 };
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-CDataCollector::CDataCollector( CTerraData *pData, const int coreCount ) :
+const char *CDataCollector::m_pSamplingModeStr[SAMPLING_MODE_COUNT] =
+{
+    "nearest",
+    "area",
+    "coverage"
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char *CDataCollector::m_pStageStr[STAGE_COUNT] =
+{
+    "read",
+    "decode",
+    "sample"
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::CDataCollector( CTerraData *pData, CThreadPool *pPool ) :
     m_pData( pData ),
-    m_coreCount( coreCount )
+    m_bIsManifestLoaded( false ),
+    m_memoryBudget( 0 ),
+    m_batchSourceCount( g_maxBatchSourceCount ),
+    m_pPool( pPool )
+{
+    assert( m_pData && m_pPool );
+    m_stageThreadCount[STAGE_READ] = g_readTaskCount;
+    m_stageThreadCount[STAGE_DECODE] = m_pPool->GetThreadCount();
+    m_stageThreadCount[STAGE_SAMPLE] = m_pPool->GetThreadCount();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::~CDataCollector()
 {
-    assert( m_pData );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::SetGeometryFile( const char *pFilenameGeom )
+{
+    assert( pFilenameGeom );
+    m_geomFilename = pFilenameGeom;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::SetRasterCache( const char *pDirectory, const uint64_t sizeLimit )
+{
+    assert( pDirectory );
+    m_pRasterCache.reset( new CRasterCache( pDirectory, sizeLimit ) );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::SetStageThreadCount( const int readCount, const int decodeCount, const int sampleCount )
+{
+    // Zero keeps the default
+    if( readCount > 0 )
+        m_stageThreadCount[STAGE_READ] = readCount;
+    if( decodeCount > 0 )
+        m_stageThreadCount[STAGE_DECODE] = decodeCount;
+    if( sampleCount > 0 )
+        m_stageThreadCount[STAGE_SAMPLE] = sampleCount;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::SetMemoryBudget( const size_t size )
+{
+    m_memoryBudget = size;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::SetBatchSourceCount( const int count )
+{
+    // Zero keeps the default
+    if( count > 0 )
+        m_batchSourceCount = count;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void CDataCollector::Collect( const char *pFilenameXML )
 {
     CollectImageData( pFilenameXML );
+    SelectChangedItems();
     //ReportInputDataQueue();
     Process();
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::LoadManifest( const char *pFilename )
+{
+    m_manifest.clear();
+    m_bIsManifestLoaded = false;
+    
+    TiXmlDocument xmlDoc( pFilename );
+    if( !xmlDoc.LoadFile() )
+        return false;
+    
+    const TiXmlElement *pRoot = xmlDoc.FirstChildElement( g_pManifestRoot );
+    int version = 0;
+    int cellCount = 0;
+    if( !pRoot || !pRoot->Attribute( g_pAttrVersion, &version ) || !pRoot->Attribute( g_pAttrCellCount, &cellCount ) ||
+        version != g_manifestVersion || cellCount != m_pData->GetCount() )
+    {
+        std::cout << "Manifest " << pFilename << " doesn't match, all items will be sampled" << std::endl;
+        return false;
+    }
+    
+    const TiXmlNode *pNode = pRoot->FirstChild( g_pCollectItem );
+    while( pNode )
+    {
+        SImageData data;
+        if( !ParseItem( pNode, &data ) )
+            return false;
+        m_manifest.push_back( data );
+        pNode = pNode->NextSiblingElement( g_pCollectItem );
+    }
+    
+    m_bIsManifestLoaded = true;
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::SaveManifest( const char *pFilename )
+{
+    CProfileScope scope( "SaveManifest", pFilename );
+    TiXmlDocument xmlDoc;
+    TiXmlElement *pRoot = new TiXmlElement( g_pManifestRoot );
+    pRoot->SetAttribute( g_pAttrVersion, g_manifestVersion );
+    pRoot->SetAttribute( g_pAttrCellCount, m_pData->GetCount() );
+    xmlDoc.LinkEndChild( pRoot );
+    
+    // Failed items are left out, so they are sampled again next time
+    char buffer[32];
+    for( size_t i = 0; i < m_imageData.size(); ++i )
+    {
+        const SImageData& data = m_imageData[i];
+        if( data.bIsFailed )
+            continue;
+        
+        TiXmlElement *pItem = new TiXmlElement( g_pCollectItem );
+        pItem->SetAttribute( data.bIsTiled ? g_pAttrName : g_pAttrFilename, data.filename.c_str() );
+        snprintf( buffer, sizeof( buffer ), "%016llx", static_cast< unsigned long long >( data.fileHash ) );
+        pItem->SetAttribute( g_pAttrHash, buffer );
+        pItem->SetAttribute( g_pAttrImageType, GetStringForImageType( data.imageType ) );
+        pItem->SetAttribute( g_pAttrDataType, GetStringForDataType( data.dataType ) );
+        pItem->SetAttribute( g_pAttrSampling, GetStringForSamplingMode( data.samplingMode ) );
+        if( data.rangeMin <= data.rangeMax )
+        {
+            snprintf( buffer, sizeof( buffer ), "%.9g", data.rangeMin );
+            pItem->SetAttribute( g_pAttrRangeMin, buffer );
+            snprintf( buffer, sizeof( buffer ), "%.9g", data.rangeMax );
+            pItem->SetAttribute( g_pAttrRangeMax, buffer );
+        }
+        if( data.month >= 0 )
+            pItem->SetAttribute( g_pAttrMonth, data.month );
+        if( data.channel > 0 )
+        {
+            const char channelStr[2] = { g_pChannelStr[data.channel], 0 };
+            pItem->SetAttribute( g_pAttrChannel, channelStr );
+        }
+        if( !data.legend.empty() )
+        {
+            pItem->SetAttribute( g_pAttrLegend, data.legend.c_str() );
+            snprintf( buffer, sizeof( buffer ), "%016llx", static_cast< unsigned long long >( data.legendHash ) );
+            pItem->SetAttribute( g_pAttrLegendHash, buffer );
+        }
+        if( IsRawImage( data.imageType ) )
+        {
+            pItem->SetAttribute( g_pAttrWidth, data.rawSizeX );
+            pItem->SetAttribute( g_pAttrHeight, data.rawSizeY );
+            pItem->SetAttribute( g_pAttrHeaderSize, data.rawHeaderSize );
+            pItem->SetAttribute( g_pAttrByteOrder, data.bIsBigEndian ? g_pByteOrderBig : g_pByteOrderLittle );
+        }
+        if( data.bHasNoData )
+        {
+            snprintf( buffer, sizeof( buffer ), "%.9g", data.noData );
+            pItem->SetAttribute( g_pAttrNoData, buffer );
+        }
+        pRoot->LinkEndChild( pItem );
+    }
+    
+    if( !xmlDoc.SaveFile( pFilename ) )
+        std::cout << "Can't save manifest: " << pFilename << std::endl;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 void CDataCollector::CollectImageData( const char *pFilenameXML )
 {
     // Open the XML-file and read
@@ -77,63 +415,342 @@ void CDataCollector::CollectImageData( const char *pFilenameXML )
         return;
     }
     
+    CollectLegends( pRoot );
+    
     const int itemCount = GetNodeChildCount( pRoot, g_pCollectItem );
     m_imageData.reserve( itemCount );
     
-    // Parse and process all collect nodes
+    // Parse and process all collect nodes. Every file is hashed once to detect its changes.
+    std::map< std::string, uint64_t > fileHash;
     const TiXmlNode *pNode = pRoot->FirstChild( g_pCollectItem );
     while( pNode )
     {
-        // Read element's data
-        const TiXmlElement *pElement = pNode->ToElement();
-        const char *pAttrFilename = pElement->Attribute( g_pAttrFilename );
-        const char *pAttrImageType = pElement->Attribute( g_pAttrImageType );
-        const char *pAttrDataType = pElement->Attribute( g_pAttrDataType );
-        const char *pAttrRangeMin = pElement->Attribute( g_pAttrRangeMin );
-        const char *pAttrRangeMax = pElement->Attribute( g_pAttrRangeMax );
-        const char *pAttrMonth = pElement->Attribute( g_pAttrMonth );
-        
-        // Parse this data into internal formats
-        const EImageType imageType = ParseImageType( pAttrImageType );
-        const EDataType dataType = ParseDataType( pAttrDataType );
-        const float rangeMin = atof( pAttrRangeMin );
-        const float rangeMax = atof( pAttrRangeMax );
-        const int month = pAttrMonth ? atoi( pAttrMonth ) : -1;
-        
-        // Create element
         SImageData data;
-        data.filename = pAttrFilename;
-        data.imageType = imageType;
-        data.dataType = dataType;
-        data.rangeMin = rangeMin;
-        data.rangeMax = rangeMax;
-        data.month = month;
+        bool bIsValid = ParseItem( pNode, &data );
+        
+        // Tiles come from the config only, the manifest keeps the hash of the mosaic
+        if( bIsValid && data.bIsTiled )
+            bIsValid = ParseTiles( pNode, &data );
+        
+        // Colour images are mapped to values by their legend
+        if( bIsValid && IMAGE_TYPE_COLOR == data.imageType )
+        {
+            data.legendID = FindLegend( data.legend );
+            bIsValid = ( data.legendID >= 0 );
+            if( bIsValid )
+                data.legendHash = m_legend[data.legendID]->GetHash();
+            else
+                std::cout << "Unknown legend \"" << data.legend << "\" of color image: " << data.filename << std::endl;
+        }
+        
+        if( bIsValid && data.bIsTiled )
+        {
+            // Hash of the mosaic covers bounds and contents of all its tiles
+            const uint64_t prime = 0x100000001b3ULL;
+            uint64_t hash = 0xcbf29ce484222325ULL;
+            for( size_t i = 0; i < data.tile.size(); ++i )
+            {
+                STile& tile = data.tile[i];
+                tile.fileHash = GetFileHash( fileHash, tile.filename );
+                hash = ( hash ^ tile.fileHash ) * prime;
+                const float bound[4] = { tile.lonMin, tile.lonMax, tile.latMin, tile.latMax };
+                for( int j = 0; j < 4; ++j )
+                {
+                    uint32_t boundBits = 0;
+                    memcpy( &boundBits, &bound[j], sizeof( boundBits ) );
+                    hash = ( hash ^ boundBits ) * prime;
+                }
+            }
+            data.fileHash = hash;
+        }
+        else if( bIsValid )
+            data.fileHash = GetFileHash( fileHash, data.filename );
+        
+        // Bands of a packed image become items of their own, the first one decodes for all
+        TImageVec band;
+        if( bIsValid && pNode->FirstChildElement( g_pItemBand ) )
+            bIsValid = ParseBands( pNode, data, &band );
         
-        m_imageData.push_back( data );
+        if( bIsValid && band.empty() )
+            m_imageData.push_back( data );
+        else if( bIsValid )
+            m_imageData.insert( m_imageData.end(), band.begin(), band.end() );
         
         // Get next element
-        pNode = pNode->NextSiblingElement();
+        pNode = pNode->NextSiblingElement( g_pCollectItem );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::CollectLegends( const TiXmlNode *pRoot )
+{
+    assert( pRoot );
+    
+    // <legend name="..." tolerance="..."> with <stop color="RRGGBB" value="..."/> children
+    const TiXmlNode *pNode = pRoot->FirstChild( g_pCollectLegend );
+    while( pNode )
+    {
+        const TiXmlElement *pElement = pNode->ToElement();
+        const char *pAttrName = pElement->Attribute( g_pAttrName );
+        int tolerance = 0;
+        pElement->Attribute( g_pAttrTolerance, &tolerance );
+        
+        std::unique_ptr< CColorLegend > pLegend( new CColorLegend() );
+        pLegend->SetTolerance( tolerance );
+        const TiXmlElement *pStop = pElement->FirstChildElement( g_pLegendStop );
+        while( pStop )
+        {
+            const char *pAttrColor = pStop->Attribute( g_pAttrColor );
+            const char *pAttrValue = pStop->Attribute( g_pAttrValue );
+            uint8_t col[3];
+            if( pAttrColor && pAttrValue && ParseColor( pAttrColor, col ) )
+                pLegend->AddStop( col[0], col[1], col[2], atof( pAttrValue ) );
+            else
+                std::cout << "Wrong stop of legend: " << ( pAttrName ? pAttrName : "" ) << std::endl;
+            pStop = pStop->NextSiblingElement( g_pLegendStop );
+        }
+        
+        if( pAttrName && pLegend->GetStopCount() > 0 )
+        {
+            pLegend->Build();
+            printf( "Legend %s: %d stop(s)\n", pAttrName, pLegend->GetStopCount() );
+            m_legendName.push_back( pAttrName );
+            m_legend.push_back( std::move( pLegend ) );
+        }
+        else
+            std::cout << "Legend without name or stops is skipped" << std::endl;
+        
+        pNode = pNode->NextSiblingElement( g_pCollectLegend );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::SelectChangedItems()
+{
+    // Field is resampled if the ordered list of its items differs from the manifest in any way,
+    // items writing the same field depend on each other. Without the manifest all fields are.
+    std::vector< bool > bIsFieldChanged( TERRA_FIELD_COUNT, !m_bIsManifestLoaded );
+    std::vector< bool > bIsFieldReset( TERRA_FIELD_COUNT, true );
+    for( int field = 0; field < TERRA_FIELD_COUNT && m_bIsManifestLoaded; ++field )
+    {
+        std::vector< const SImageData* > current;
+        std::vector< const SImageData* > previous;
+        for( size_t i = 0; i < m_imageData.size(); ++i )
+            if( GetFieldID( m_imageData[i] ) == field )
+                current.push_back( &m_imageData[i] );
+        for( size_t i = 0; i < m_manifest.size(); ++i )
+            if( GetFieldID( m_manifest[i] ) == field )
+                previous.push_back( &m_manifest[i] );
+        
+        bool bIsSame = ( current.size() == previous.size() );
+        for( size_t i = 0; bIsSame && i < current.size(); ++i )
+            bIsSame = IsSameItem( *current[i], *previous[i] );
+        bIsFieldChanged[field] = !bIsSame;
+        bIsFieldReset[field] = !bIsSame || current.empty();
+    }
+    
+    // Only fields kept from the manifest keep loaded values, others are sampled from scratch
+    // or left empty, even if the data file had them
+    m_pData->ResetFields( bIsFieldReset );
+    
+    int changedCount = 0;
+    for( size_t i = 0; i < m_imageData.size(); ++i )
+    {
+        SImageData& data = m_imageData[i];
+        const int field = GetFieldID( data );
+        data.bIsChanged = ( field < 0 ) || bIsFieldChanged[field];
+        if( data.bIsChanged )
+            ++changedCount;
+    }
+    
+    printf( "Items to sample: %d of %d\n", changedCount, static_cast< int >( m_imageData.size() ) );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::CreateSources()
+{
+    // Every image is a source, every tile of a tiled item is a source of its own. Bands of
+    // a packed image are sampled by the sources of the first band if any changed.
+    const int imageCount = static_cast< int >( m_imageData.size() );
+    m_source.clear();
+    m_tileIndex.clear();
+    m_tileIndex.resize( imageCount );
+    for( int i = 0; i < imageCount; ++i )
+    {
+        bool bIsChanged = false;
+        for( int b = 0; b < m_imageData[i].bandCount; ++b )
+            bIsChanged = bIsChanged || m_imageData[i + b].bIsChanged;
+        if( !bIsChanged )
+            continue;
+        
+        if( !m_imageData[i].bIsTiled )
+        {
+            m_source.push_back( std::unique_ptr< SSource >( new SSource( i, -1 ) ) );
+            continue;
+        }
+        
+        m_tileIndex[i] = CreateTileIndex( m_imageData[i] );
+        const STileIndex& index = *m_tileIndex[i];
+        for( size_t t = 0; t + 1 < index.cellStart.size(); ++t )
+            if( index.cellStart[t] < index.cellStart[t + 1] )
+                m_source.push_back( std::unique_ptr< SSource >( new SSource( i, static_cast< int >( t ) ) ) );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CDataCollector::CreateCellJobs()
+{
+    assert( m_pData );
+    
+    const int cellCount = m_pData->GetCount();
+    const int maxJobCount = std::max( 1, cellCount / g_minJobCellCount );
+    const int jobCount = std::min( m_pPool->GetThreadCount() * g_jobPerCore, maxJobCount );
+    
+    // Cell ranges are the same for all images
+    std::vector< int >& rangeBound = m_rangeBound;
+    rangeBound.resize( jobCount + 1 );
+    for( int j = 0; j < jobCount; ++j )
+    {
+        const int64_t bound = static_cast< int64_t >( cellCount ) * j / jobCount;
+        rangeBound[j] = static_cast< int >( bound - bound % g_jobCellAlign );
+    }
+    rangeBound[jobCount] = cellCount;
+    
+    // Consecutive images form a batch with one job per cell range, so a cell is loaded once
+    // for all months of the batch. Every tile source has one job.
+    const int imageCount = static_cast< int >( m_imageData.size() );
+    const int sourceCount = static_cast< int >( m_source.size() );
+    m_cellJobs.clear();
+    m_cellJobs.reserve( imageCount * jobCount );
+    m_rangeTurn.assign( imageCount * jobCount, -1 );
+    m_rangeWriter.assign( imageCount * jobCount, 0 );
+    std::vector< int > rangeTurnCount( jobCount, 0 );
+    int batchCount = 0;
+    for( int s = 0; s < sourceCount; )
+    {
+        const int imageID = m_source[s]->imageID;
+        int *pWriter = &m_rangeWriter[imageID * jobCount];
+        if( m_source[s]->tileID >= 0 )
+        {
+            const STileIndex& index = *m_tileIndex[imageID];
+            for( ; s < sourceCount && m_source[s]->imageID == imageID; ++s )
+            {
+                SSource& source = *m_source[s];
+                const int cellBegin = index.cellStart[source.tileID];
+                const int cellEnd = index.cellStart[source.tileID + 1];
+                source.jobBegin = static_cast< int >( m_cellJobs.size() );
+                m_cellJobs.push_back( SCellJob( s, 1, -1, cellBegin, cellEnd ) );
+                source.jobEnd = static_cast< int >( m_cellJobs.size() );
+                source.jobLeft = 1;
+                
+                // Ranges written by the tile, its cells are ascending
+                int rangeID = -1;
+                for( int c = cellBegin; c < cellEnd; ++c )
+                    if( rangeID < 0 || index.cellID[c] >= rangeBound[rangeID + 1] )
+                    {
+                        while( index.cellID[c] >= rangeBound[rangeID + 1] )
+                            ++rangeID;
+                        ++pWriter[rangeID];
+                    }
+            }
+        }
+        else
+        {
+            // Cells of a batch are held until its jobs are done, so the batch grows while its
+            // cells and the decode of any of its sources fit the budget
+            size_t cellSize = m_source[s]->cellSize;
+            size_t decodeSize = m_source[s]->decodeSize;
+            int batchEnd = s + 1;
+            while( batchEnd < sourceCount && batchEnd - s < m_batchSourceCount && m_source[batchEnd]->tileID < 0 )
+            {
+                const SSource& next = *m_source[batchEnd];
+                decodeSize = std::max( decodeSize, next.decodeSize );
+                if( m_memoryBudget > 0 && cellSize + next.cellSize + decodeSize > m_memoryBudget )
+                    break;
+                cellSize += next.cellSize;
+                ++batchEnd;
+            }
+            
+            // Jobs belong to the last source, they are released when the whole batch is decoded.
+            // Every job frees the cells of all sources of the batch.
+            for( int b = s; b < batchEnd; ++b )
+            {
+                m_source[b]->jobBegin = m_source[b]->jobEnd = static_cast< int >( m_cellJobs.size() );
+                m_source[b]->jobLeft = jobCount;
+            }
+            for( int j = 0; j < jobCount; ++j )
+            {
+                m_cellJobs.push_back( SCellJob( s, batchEnd - s, j, rangeBound[j], rangeBound[j + 1] ) );
+                ++pWriter[j];
+            }
+            m_source[batchEnd - 1]->jobEnd = static_cast< int >( m_cellJobs.size() );
+            s = batchEnd;
+            ++batchCount;
+        }
+        
+        // Items take turns in every range in the order of the config. A batch writes in the
+        // turn of its first item, its sources write every cell in their order.
+        for( int j = 0; j < jobCount; ++j )
+            if( pWriter[j] > 0 )
+                m_rangeTurn[imageID * jobCount + j] = rangeTurnCount[j]++;
     }
+    
+    if( batchCount > 0 )
+        printf( "Image batches: %d\n", batchCount );
+    return jobCount;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void CDataCollector::Process()
 {
     assert( m_pData );
     
-    // Start thread pool
-    std::mutex jobMutex;
-    std::mutex dataMutex;
+    // Split every image into cell ranges so all cores sample every image
+    CProfileScope scope( "Process" );
+    CreateSources();
+    const int sourceCount = static_cast< int >( m_source.size() );
+    
+    // Headers are probed and coverages are created before the pipeline starts, so no task
+    // waits for tasks it would submit itself. Batches are sized by the estimates.
+    m_pPool->ParallelFor( sourceCount, [ this ]( const int begin, const int end )
+    {
+        for( int i = begin; i < end; ++i )
+            EstimateSource( this, *m_source[i] );
+    } );
+    const int rangeCount = CreateCellJobs();
+    for( int i = 0; i < sourceCount; ++i )
+    {
+        const SSource& source = *m_source[i];
+        if( source.tileID < 0 && source.sizeX > 0 && SAMPLING_MODE_COVERAGE == m_imageData[source.imageID].samplingMode )
+            AcquireCoverage( this, source.sizeX, source.sizeY, m_pPool );
+    }
+    
+    // Read, decode and sample tasks run on the shared pool. Every task schedules the next
+    // ones when it's done. Stage limits, queue sizes and the memory budget keep only a few
+    // sources in memory at a time.
+    SPipeline pipeline( sourceCount, static_cast< int >( m_cellJobs.size() ), rangeCount, m_memoryBudget );
+    const uint64_t timeStart = GetTimeUS();
+    {
+        std::unique_lock< std::mutex > lock( pipeline.mtx );
+        Schedule( this, pipeline );
+        while( pipeline.jobLeft > 0 )
+            pipeline.doneCV.wait( lock );
+    }
+    
+    ReportStageStats( pipeline, GetTimeUS() - timeStart );
+    ReportMemoryBudget( pipeline.budget );
+    
+    for( size_t i = 0; i < m_source.size(); ++i )
+    {
+        const int imageID = m_source[i]->imageID;
+        for( int b = 0; b < m_imageData[imageID].bandCount && m_source[i]->bIsFailed; ++b )
+            m_imageData[imageID + b].bIsFailed = true;
+    }
     
-    std::vector< std::thread > threadPool;
-    threadPool.reserve( m_coreCount );
-    for( int i = 0; i < m_coreCount; ++i )
-        threadPool.push_back( std::thread( ThreadProcessImage, i, this, std::ref( jobMutex ), std::ref( dataMutex ) ) );
-     
-    // Waiting until all process finished
-    for( int i = 0; i < m_coreCount; ++i )
-        threadPool[i].join();
+    m_source.clear();
+    m_cellJobs.clear();
+    m_pixelMap.clear();
+    m_areaMap.clear();
+    m_coverage.clear();
+    m_tileIndex.clear();
         
     // Create terra data
+    m_pData->UpdateFlags();
     m_pData->Check();
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -142,204 +759,1649 @@ int CDataCollector::GetNodeChildCount( const TiXmlNode *pRoot, const char *pChil
     assert( pRoot && pChildName );
     
     int retCount = 0;
-    const TiXmlNode *pNode = pRoot->FirstChild( g_pCollectItem );
+    const TiXmlNode *pNode = pRoot->FirstChild( pChildName );
     while( pNode )
     {
         ++retCount;
-        pNode = pNode->NextSiblingElement();
+        pNode = pNode->NextSiblingElement( pChildName );
     }
     return retCount;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-CDataCollector::EImageType CDataCollector::ParseImageType( const char *pImageTypeStr )
+bool CDataCollector::ParseItem( const TiXmlNode *pNode, SImageData *pData )
 {
-    for( int i = 0; i < IMAGE_TYPE_COUNT; ++i )
-        if( strncmp( pImageTypeStr, m_pImageTypeStr[i], strlen( m_pImageTypeStr[i] ) ) == 0 )
+    assert( pNode && pData );
+    
+    // Read element's data
+    const TiXmlElement *pElement = pNode->ToElement();
+    const char *pAttrFilename = pElement->Attribute( g_pAttrFilename );
+    const char *pAttrName = pElement->Attribute( g_pAttrName );
+    const char *pAttrImageType = pElement->Attribute( g_pAttrImageType );
+    const char *pAttrDataType = pElement->Attribute( g_pAttrDataType );
+    const char *pAttrRangeMin = pElement->Attribute( g_pAttrRangeMin );
+    const char *pAttrRangeMax = pElement->Attribute( g_pAttrRangeMax );
+    const char *pAttrMonth = pElement->Attribute( g_pAttrMonth );
+    const char *pAttrSampling = pElement->Attribute( g_pAttrSampling );
+    const char *pAttrHash = pElement->Attribute( g_pAttrHash );
+    const char *pAttrLegend = pElement->Attribute( g_pAttrLegend );
+    const char *pAttrLegendHash = pElement->Attribute( g_pAttrLegendHash );
+    const char *pAttrByteOrder = pElement->Attribute( g_pAttrByteOrder );
+    const char *pAttrNoData = pElement->Attribute( g_pAttrNoData );
+    const char *pAttrChannel = pElement->Attribute( g_pAttrChannel );
+    const bool bHasBands = ( pElement->FirstChildElement( g_pItemBand ) != nullptr );
+    if( ( !pAttrFilename && !pAttrName ) || !pAttrImageType || ( !pAttrDataType && !bHasBands ) )
+    {
+        std::cout << "Item has no required attribute(s)" << std::endl;
+        return false;
+    }
+    
+    // Parse this data into internal formats
+    pData->filename = pAttrFilename ? pAttrFilename : pAttrName;
+    pData->bIsTiled = !pAttrFilename;
+    pData->imageType = ParseImageType( pAttrImageType );
+    pData->dataType = pAttrDataType ? ParseDataType( pAttrDataType ) : DATA_TYPE_COUNT;
+    pData->samplingMode = pAttrSampling ? ParseSamplingMode( pAttrSampling ) : SAMPLING_MODE_NEAREST;
+    pData->month = pAttrMonth ? atoi( pAttrMonth ) : -1;
+    pData->channel = pAttrChannel ? ParseChannel( pAttrChannel ) : 0;
+    pData->legend = pAttrLegend ? pAttrLegend : "";
+    pData->legendHash = pAttrLegendHash ? strtoull( pAttrLegendHash, nullptr, 16 ) : 0;
+    pData->fileHash = pAttrHash ? strtoull( pAttrHash, nullptr, 16 ) : 0;
+    
+    // Values of colour images come from the legend and raw samples are values themselves,
+    // so the range is needed for gray scale only
+    if( pAttrRangeMin && pAttrRangeMax )
+    {
+        pData->rangeMin = atof( pAttrRangeMin );
+        pData->rangeMax = atof( pAttrRangeMax );
+    }
+    else if( IMAGE_TYPE_GRAY_SCALE == pData->imageType && !bHasBands )
+    {
+        std::cout << "Gray scale item has no range: " << pData->filename << std::endl;
+        return false;
+    }
+    if( pData->channel < 0 )
+    {
+        std::cout << "Item has wrong channel: " << pData->filename << std::endl;
+        return false;
+    }
+    if( !ParseNoData( pAttrNoData, pData ) )
+        return false;
+    
+    // Raw rasters have no header to read their layout from
+    if( IsRawImage( pData->imageType ) )
+    {
+        pElement->Attribute( g_pAttrWidth, &pData->rawSizeX );
+        pElement->Attribute( g_pAttrHeight, &pData->rawSizeY );
+        pElement->Attribute( g_pAttrHeaderSize, &pData->rawHeaderSize );
+        pData->bIsBigEndian = pAttrByteOrder && ( 0 == strcmp( pAttrByteOrder, g_pByteOrderBig ) );
+        if( pData->rawSizeX <= 0 || pData->rawSizeY <= 0 || pData->rawHeaderSize < 0 )
         {
-            const EImageType retType = static_cast< EImageType >( i );
-            return retType;
+            std::cout << "Raw item has no valid width and height: " << pData->filename << std::endl;
+            return false;
         }
+    }
     
-    std::cout << "Unknown EImageType type" << std::endl;
-    return IMAGE_TYPE_COUNT;
+    return true;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-CDataCollector::EDataType CDataCollector::ParseDataType( const char *pDataTypeStr )
+bool CDataCollector::ParseTiles( const TiXmlNode *pNode, SImageData *pData )
 {
-    for( int i = 0; i < DATA_TYPE_COUNT; ++i )
-        if( strncmp( pDataTypeStr, m_pDataTypeStr[i], strlen( m_pDataTypeStr[i] ) ) == 0 )
+    assert( pNode && pData );
+    
+    // <tile filename="..." lonMin="..." lonMax="..." latMin="..." latMax="..."/>. Longitudes
+    // may be given either in [-180, 180] or in [0, 360].
+    const TiXmlElement *pTileElement = pNode->FirstChildElement( g_pItemTile );
+    while( pTileElement )
+    {
+        STile tile;
+        const char *pAttrFilename = pTileElement->Attribute( g_pAttrFilename );
+        double bound[4] = { 0.0, 0.0, 0.0, 0.0 };
+        const bool bHasBounds = pTileElement->Attribute( g_pAttrLonMin, &bound[0] ) &&
+                                pTileElement->Attribute( g_pAttrLonMax, &bound[1] ) &&
+                                pTileElement->Attribute( g_pAttrLatMin, &bound[2] ) &&
+                                pTileElement->Attribute( g_pAttrLatMax, &bound[3] );
+        tile.lonMin = static_cast< float >( bound[0] );
+        tile.lonMax = static_cast< float >( bound[1] );
+        tile.latMin = static_cast< float >( bound[2] );
+        tile.latMax = static_cast< float >( bound[3] );
+        if( !pAttrFilename || !bHasBounds || tile.lonMax <= tile.lonMin || tile.lonMax - tile.lonMin > 360.0f ||
+            tile.latMax <= tile.latMin || tile.latMin < -90.0f || tile.latMax > 90.0f )
         {
-            const EDataType retType = static_cast< EDataType >( i );
-            return retType;
+            std::cout << "Tile of item " << pData->filename << " has no filename or valid bounds" << std::endl;
+            return false;
         }
+        
+        tile.filename = pAttrFilename;
+        pData->tile.push_back( tile );
+        pTileElement = pTileElement->NextSiblingElement( g_pItemTile );
+    }
     
-    std::cout << "Unknown EDataType type" << std::endl;
-    return DATA_TYPE_COUNT;
-}
-////////////////////////////////////////////////////////////////////////////////////////////////////
-const char *CDataCollector::GetStringForImageType( const EImageType type )
-{
-    assert( type >= 0 && type < IMAGE_TYPE_COUNT );
-    return m_pImageTypeStr[type];
-}
-////////////////////////////////////////////////////////////////////////////////////////////////////
-const char *CDataCollector::GetStringForDataType( const EDataType type )
-{
-    assert( type >= 0 && type < DATA_TYPE_COUNT );
-    return m_pDataTypeStr[type];
+    if( pData->tile.empty() )
+    {
+        std::cout << "Tiled item has no tiles: " << pData->filename << std::endl;
+        return false;
+    }
+    
+    // Cells are routed to tiles by their centers, footprints may cross tile borders
+    if( SAMPLING_MODE_NEAREST != pData->samplingMode )
+    {
+        std::cout << "Tiled item supports nearest sampling only: " << pData->filename << std::endl;
+        return false;
+    }
+    
+    return true;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void CDataCollector::ThreadProcessImage( const int threadID, CDataCollector *pThis,
-                                         std::mutex& jobMutex, std::mutex& dataMutex )
+bool CDataCollector::ParseBands( const TiXmlNode *pNode, const SImageData& data, TImageVec *pBand )
 {
-    // Infinite loop to process task
-    for( ; ; )
+    assert( pNode && pBand );
+    
+    // <band channel="r|g|b" dataType="..." rangeMin="..." rangeMax="..." month="..."/>. Every
+    // band scales its channel of a gray scale image into its own range.
+    if( IMAGE_TYPE_GRAY_SCALE != data.imageType )
     {
-        // Find first unprocessed task
-        int workID = -1;
-        jobMutex.lock();
-        for( size_t i = 0; i < pThis->m_imageData.size(); ++i )
-            if( !pThis->m_imageData[i].bWasStarted )
-            {
-                pThis->m_imageData[i].bWasStarted = true;
-                workID = static_cast< int >( i );
-                break;
-            }
-        jobMutex.unlock();
+        std::cout << "Bands are supported by gray scale items only: " << data.filename << std::endl;
+        return false;
+    }
+    
+    const TiXmlElement *pBandElement = pNode->FirstChildElement( g_pItemBand );
+    while( pBandElement )
+    {
+        const char *pAttrChannel = pBandElement->Attribute( g_pAttrChannel );
+        const char *pAttrDataType = pBandElement->Attribute( g_pAttrDataType );
+        const char *pAttrRangeMin = pBandElement->Attribute( g_pAttrRangeMin );
+        const char *pAttrRangeMax = pBandElement->Attribute( g_pAttrRangeMax );
+        const char *pAttrMonth = pBandElement->Attribute( g_pAttrMonth );
+        const char *pAttrNoData = pBandElement->Attribute( g_pAttrNoData );
+        SImageData band = data;
+        band.channel = pAttrChannel ? ParseChannel( pAttrChannel ) : -1;
+        if( band.channel < 0 || !pAttrDataType || !pAttrRangeMin || !pAttrRangeMax )
+        {
+            std::cout << "Band of item " << data.filename << " has no channel, data type or range" << std::endl;
+            return false;
+        }
         
-        // No more unprocessed images
-        if( -1 == workID )
-            break;
+        band.dataType = ParseDataType( pAttrDataType );
+        band.rangeMin = atof( pAttrRangeMin );
+        band.rangeMax = atof( pAttrRangeMax );
+        band.month = pAttrMonth ? atoi( pAttrMonth ) : -1;
+        band.bandCount = 0;
         
-        // Do your job
-        SImageData& imageData = pThis->m_imageData[workID];
-        ProcessImage( pThis, imageData, dataMutex );
-        imageData.bWasStarted = true;
+        // Nodata of the band, of the item or the default of the band data type
+        if( ( pAttrNoData || !band.bHasNoData ) && !ParseNoData( pAttrNoData, &band ) )
+            return false;
+        pBand->push_back( band );
+        pBandElement = pBandElement->NextSiblingElement( g_pItemBand );
+    }
+    
+    if( static_cast< int >( pBand->size() ) > g_maxBandCount )
+    {
+        std::cout << "Item has more than " << g_maxBandCount << " bands: " << data.filename << std::endl;
+        return false;
     }
     
-    printf( "Thread %d finished\n", threadID );
+    pBand->front().bandCount = static_cast< int >( pBand->size() );
+    return true;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void CDataCollector::ProcessImage( CDataCollector *pThis, const SImageData& imageData, std::mutex& mtx )
+bool CDataCollector::ParseColor( const char *pColorStr, uint8_t *pCol )
 {
-    // Использован код из:
-    // http://code.google.com/p/jpeg-compressor/
-
-    // Загружаем файл
-    int imageSizeX = 0;
-    int imageSizeY = 0;
-    int actualComps = 0;
-    int reqComps = 4;
-    uint8_t *pBuffer = jpgd::decompress_jpeg_image_from_file( imageData.filename.c_str(), &imageSizeX, &imageSizeY, &actualComps, reqComps );
+    assert( pColorStr && pCol );
     
-    assert( pBuffer );
+    // "RRGGBB" or "#RRGGBB"
+    if( '#' == pColorStr[0] )
+        ++pColorStr;
+    if( strlen( pColorStr ) != 6 )
+        return false;
     
-    const float sizeX = static_cast< float >( imageSizeX - 1 ); 
-    const float sizeY = static_cast< float >( imageSizeY - 1 );
-    const size_t pixelStride = sizeof( uint8_t ) * 4;
+    char *pEnd = nullptr;
+    const unsigned long color = strtoul( pColorStr, &pEnd, 16 );
+    if( *pEnd != 0 )
+        return false;
     
-    // Go through all terraData
-    assert( pThis->m_pData );
-    const int cellCount = pThis->m_pData->GetCount();
-    for( int i = 0; i < cellCount; ++i )
+    pCol[0] = static_cast< uint8_t >( ( color >> 16 ) & 0xFF );
+    pCol[1] = static_cast< uint8_t >( ( color >> 8 ) & 0xFF );
+    pCol[2] = static_cast< uint8_t >( color & 0xFF );
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CDataCollector::ParseChannel( const char *pChannelStr )
+{
+    for( int i = 0; g_pChannelStr[i]; ++i )
+        if( pChannelStr[0] == g_pChannelStr[i] && 0 == pChannelStr[1] )
+            return i;
+    return -1;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::ParseNoData( const char *pNoDataStr, SImageData *pData )
+{
+    assert( pData );
+    
+    // Raw samples equal to nodata are left out of sampling. Gray scale cells of the nodata
+    // level are not valid, white is nodata of gray scale heights unless told otherwise.
+    const bool bIsHeight = ( DATA_TYPE_TOPOGRAPHY == pData->dataType || DATA_TYPE_OCEAN_DEPTH == pData->dataType );
+    pData->bHasNoData = ( pNoDataStr != nullptr );
+    pData->noData = pNoDataStr ? atof( pNoDataStr ) : 0.0f;
+    if( IMAGE_TYPE_GRAY_SCALE == pData->imageType && !pNoDataStr && bIsHeight )
     {
-        STerraData& data = pThis->m_pData->GetData( i );
-        
-        // Recalc angles to pixel coordinates
+        pData->bHasNoData = true;
+        pData->noData = 255.0f;
+    }
+    
+    const bool bIsLevel = ( pData->noData >= 0.0f && pData->noData <= 255.0f && pData->noData == floorf( pData->noData ) );
+    if( pNoDataStr && IMAGE_TYPE_COLOR == pData->imageType )
+    {
+        std::cout << "Colour item has nodata, its legend tells valid colours: " << pData->filename << std::endl;
+        return false;
+    }
+    if( pData->bHasNoData && IMAGE_TYPE_GRAY_SCALE == pData->imageType && !bIsLevel )
+    {
+        std::cout << "Nodata of gray scale item is not a level of 0..255: " << pData->filename << std::endl;
+        return false;
+    }
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CDataCollector::FindLegend( const std::string& name ) const
+{
+    for( size_t i = 0; i < m_legendName.size(); ++i )
+        if( m_legendName[i] == name )
+            return static_cast< int >( i );
+    return -1;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::IsRawImage( const EImageType type )
+{
+    return IMAGE_TYPE_RAW_INT16 == type || IMAGE_TYPE_RAW_FLOAT32 == type;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::IsSameItem( const SImageData& a, const SImageData& b )
+{
+    return a.filename == b.filename &&
+           a.fileHash == b.fileHash &&
+           a.imageType == b.imageType &&
+           a.dataType == b.dataType &&
+           a.samplingMode == b.samplingMode &&
+           a.rangeMin == b.rangeMin &&
+           a.rangeMax == b.rangeMax &&
+           a.month == b.month &&
+           a.channel == b.channel &&
+           a.legend == b.legend &&
+           a.legendHash == b.legendHash &&
+           a.rawSizeX == b.rawSizeX &&
+           a.rawSizeY == b.rawSizeY &&
+           a.rawHeaderSize == b.rawHeaderSize &&
+           a.bIsBigEndian == b.bIsBigEndian &&
+           a.bHasNoData == b.bHasNoData &&
+           a.noData == b.noData &&
+           a.bIsTiled == b.bIsTiled;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CDataCollector::GetFieldID( const SImageData& data )
+{
+    const bool bIsMonthValid = ( data.month >= 0 && data.month < 12 );
+    switch( data.dataType )
+    {
+        case DATA_TYPE_TOPOGRAPHY:
+        case DATA_TYPE_OCEAN_DEPTH:
+            return TERRA_FIELD_HEIGHT;
+        case DATA_TYPE_POPULATION:
+            return TERRA_FIELD_POPULATION;
+        case DATA_TYPE_TEMPERATURE_DAY:
+            return bIsMonthValid ? TERRA_FIELD_TEMP_DAY + data.month : -1;
+        case DATA_TYPE_TEMPERATURE_NIGHT:
+            return bIsMonthValid ? TERRA_FIELD_TEMP_NIGHT + data.month : -1;
+        case DATA_TYPE_TEMPERATURE_SEA:
+            return bIsMonthValid ? TERRA_FIELD_TEMP_SEA + data.month : -1;
+        default:
+            return -1;
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::IsInTile( const STile& tile, const float lat, const float lon )
+{
+    const float lonOffset = fmod( lon - tile.lonMin + 720.0f, 360.0f );
+    return lat >= tile.latMin && lat <= tile.latMax && lonOffset < tile.lonMax - tile.lonMin;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+std::unique_ptr< CDataCollector::STileIndex > CDataCollector::CreateTileIndex( const SImageData& data )
+{
+    assert( data.bIsTiled );
+    
+    // Tiles overlapping every one degree bin. Bins of longitude wrap around.
+    const int tileCount = static_cast< int >( data.tile.size() );
+    std::vector< std::vector< int > > binTile( g_tileBinCountLon * g_tileBinCountLat );
+    for( int t = 0; t < tileCount; ++t )
+    {
+        const STile& tile = data.tile[t];
+        const int binLat0 = std::max( 0, static_cast< int >( floor( tile.latMin + 90.0f ) ) );
+        const int binLat1 = std::min( g_tileBinCountLat - 1, static_cast< int >( floor( tile.latMax + 90.0f ) ) );
+        const int binLon0 = static_cast< int >( floor( tile.lonMin ) );
+        const int binLon1 = std::min( binLon0 + g_tileBinCountLon - 1, static_cast< int >( floor( tile.lonMax ) ) );
+        for( int binLat = binLat0; binLat <= binLat1; ++binLat )
+            for( int binLon = binLon0; binLon <= binLon1; ++binLon )
+            {
+                const int binX = ( ( binLon % g_tileBinCountLon ) + g_tileBinCountLon ) % g_tileBinCountLon;
+                binTile[binLat * g_tileBinCountLon + binX].push_back( t );
+            }
+    }
+    
+    // Every cell goes to the first tile containing its center, so overlapping tiles don't
+    // sample the same cell twice
+    const int cellCount = m_pData->GetCount();
+    std::vector< int > cellTile( cellCount, -1 );
+    std::unique_ptr< STileIndex > pIndex( new STileIndex );
+    pIndex->cellStart.assign( tileCount + 1, 0 );
+    int routedCount = 0;
+    for( int i = 0; i < cellCount; ++i )
+    {
+        const STerraData& cell = m_pData->GetData( i );
+        const int binLat = std::max( 0, std::min( g_tileBinCountLat - 1, static_cast< int >( floor( cell.angleLat + 90.0f ) ) ) );
+        const int binLon = std::max( 0, std::min( g_tileBinCountLon - 1, static_cast< int >( floor( fmod( cell.angleLon + 360.0f, 360.0f ) ) ) ) );
+        const std::vector< int >& candidate = binTile[binLat * g_tileBinCountLon + binLon];
+        for( size_t c = 0; c < candidate.size(); ++c )
+            if( IsInTile( data.tile[candidate[c]], cell.angleLat, cell.angleLon ) )
+            {
+                cellTile[i] = candidate[c];
+                ++pIndex->cellStart[candidate[c] + 1];
+                ++routedCount;
+                break;
+            }
+    }
+    
+    for( int t = 0; t < tileCount; ++t )
+        pIndex->cellStart[t + 1] += pIndex->cellStart[t];
+    pIndex->cellID.resize( routedCount );
+    std::vector< int > tilePos( pIndex->cellStart.begin(), pIndex->cellStart.end() - 1 );
+    for( int i = 0; i < cellCount; ++i )
+        if( cellTile[i] >= 0 )
+            pIndex->cellID[tilePos[cellTile[i]]++] = i;
+    
+    printf( "Tiled item %s: %d tile(s) cover %d of %d cells\n", data.filename.c_str(), tileCount, routedCount, cellCount );
+    return pIndex;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::EImageType CDataCollector::ParseImageType( const char *pImageTypeStr )
+{
+    for( int i = 0; i < IMAGE_TYPE_COUNT; ++i )
+        if( strncmp( pImageTypeStr, m_pImageTypeStr[i], strlen( m_pImageTypeStr[i] ) ) == 0 )
+        {
+            const EImageType retType = static_cast< EImageType >( i );
+            return retType;
+        }
+    
+    std::cout << "Unknown EImageType type" << std::endl;
+    return IMAGE_TYPE_COUNT;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::EDataType CDataCollector::ParseDataType( const char *pDataTypeStr )
+{
+    for( int i = 0; i < DATA_TYPE_COUNT; ++i )
+        if( strncmp( pDataTypeStr, m_pDataTypeStr[i], strlen( m_pDataTypeStr[i] ) ) == 0 )
+        {
+            const EDataType retType = static_cast< EDataType >( i );
+            return retType;
+        }
+    
+    std::cout << "Unknown EDataType type" << std::endl;
+    return DATA_TYPE_COUNT;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CDataCollector::ESamplingMode CDataCollector::ParseSamplingMode( const char *pSamplingModeStr )
+{
+    for( int i = 0; i < SAMPLING_MODE_COUNT; ++i )
+        if( strncmp( pSamplingModeStr, m_pSamplingModeStr[i], strlen( m_pSamplingModeStr[i] ) ) == 0 )
+        {
+            const ESamplingMode retMode = static_cast< ESamplingMode >( i );
+            return retMode;
+        }
+    
+    std::cout << "Unknown ESamplingMode type, use " << m_pSamplingModeStr[SAMPLING_MODE_NEAREST] << std::endl;
+    return SAMPLING_MODE_NEAREST;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char *CDataCollector::GetStringForImageType( const EImageType type )
+{
+    assert( type >= 0 && type < IMAGE_TYPE_COUNT );
+    return m_pImageTypeStr[type];
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char *CDataCollector::GetStringForDataType( const EDataType type )
+{
+    assert( type >= 0 && type < DATA_TYPE_COUNT );
+    return m_pDataTypeStr[type];
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char *CDataCollector::GetStringForSamplingMode( const ESamplingMode mode )
+{
+    assert( mode >= 0 && mode < SAMPLING_MODE_COUNT );
+    return m_pSamplingModeStr[mode];
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::Schedule( CDataCollector *pThis, SPipeline& pipeline )
+{
+    // Called with the pipeline locked. Later stages go first, they free memory.
+    CThreadPool *pPool = pThis->m_pPool;
+    const int *pLimit = pThis->m_stageThreadCount;
+    while( pipeline.taskCount[STAGE_SAMPLE] < pLimit[STAGE_SAMPLE] && !pipeline.sampleReady.empty() )
+    {
+        const int jobID = pipeline.sampleReady.front();
+        pipeline.sampleReady.pop_front();
+        ++pipeline.taskCount[STAGE_SAMPLE];
+        pPool->Submit( std::bind( TaskSample, pThis, std::ref( pipeline ), jobID ) );
+    }
+    
+    const size_t sampleQueueSize = pipeline.ticket.size() * g_queueSizePerTask;
+    while( pipeline.taskCount[STAGE_DECODE] < pLimit[STAGE_DECODE] && !pipeline.decodeReady.empty() &&
+           pipeline.sampleReady.size() < sampleQueueSize )
+    {
+        const int sourceID = pipeline.decodeReady.front();
+        pipeline.decodeReady.pop_front();
+        ++pipeline.taskCount[STAGE_DECODE];
+        pPool->Submit( std::bind( TaskDecode, pThis, std::ref( pipeline ), sourceID ) );
+    }
+    
+    // Sources are admitted in order. A source admitted out of order could take the memory
+    // needed by earlier ones, whose turns it waits for.
+    const int sourceCount = static_cast< int >( pThis->m_source.size() );
+    const size_t decodeQueueSize = pLimit[STAGE_DECODE] * g_queueSizePerTask;
+    while( pipeline.taskCount[STAGE_READ] < pLimit[STAGE_READ] && pipeline.nextAdmit < sourceCount &&
+           pipeline.decodeReady.size() + pipeline.taskCount[STAGE_READ] < decodeQueueSize )
+    {
+        const int sourceID = pipeline.nextAdmit;
+        const SSource& source = *pThis->m_source[sourceID];
+        if( !TryAcquireMemory( pipeline.budget, sourceID, source.decodeSize + source.cellSize ) )
+            break;
+        
+        ++pipeline.nextAdmit;
+        ++pipeline.taskCount[STAGE_READ];
+        pPool->Submit( std::bind( TaskRead, pThis, std::ref( pipeline ), sourceID ) );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::TaskRead( CDataCollector *pThis, SPipeline& pipeline, const int sourceID )
+{
+    const uint64_t timeStart = GetTimeUS();
+    SSource& source = *pThis->m_source[sourceID];
+    source.bIsFailed = !ReadSource( pThis, source );
+    const uint64_t timeRead = GetTimeUS();
+    
+    std::lock_guard< std::mutex > lock( pipeline.mtx );
+    --pipeline.taskCount[STAGE_READ];
+    ++pipeline.stats[STAGE_READ].taskCount;
+    pipeline.stats[STAGE_READ].busyTimeUS += timeRead - timeStart;
+    pipeline.decodeReady.push_back( sourceID );
+    Schedule( pThis, pipeline );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::TaskDecode( CDataCollector *pThis, SPipeline& pipeline, const int sourceID )
+{
+    const uint64_t timeStart = GetTimeUS();
+    SSource& source = *pThis->m_source[sourceID];
+    if( !source.bIsFailed && !DecodeSource( pThis, source ) )
+    {
+        std::cout << "Can't decode image: " << GetSourceFilename( pThis, source ) << std::endl;
+        TCellColorVec().swap( source.cellColor );
+        TCellValueVec().swap( source.cellValue );
+        source.bIsFailed = true;
+    }
+    std::vector< uint8_t >().swap( source.fileData );
+    const uint64_t timeDecoded = GetTimeUS();
+    
+    std::lock_guard< std::mutex > lock( pipeline.mtx );
+    --pipeline.taskCount[STAGE_DECODE];
+    ++pipeline.stats[STAGE_DECODE].taskCount;
+    pipeline.stats[STAGE_DECODE].busyTimeUS += timeDecoded - timeStart;
+    ReleaseMemory( pipeline.budget, source.decodeSize );
+    
+    // Jobs are released in the source order, so the pool starts writers of a range in the
+    // order of their turns and a writer waits only for writers started before it. Jobs of
+    // failed sources go too, they pass the turns of their item.
+    pipeline.bIsDecoded[sourceID] = true;
+    const int sourceCount = static_cast< int >( pThis->m_source.size() );
+    while( pipeline.nextRelease < sourceCount && pipeline.bIsDecoded[pipeline.nextRelease] )
+    {
+        const SSource& released = *pThis->m_source[pipeline.nextRelease++];
+        for( int j = released.jobBegin; j < released.jobEnd; ++j )
+            pipeline.sampleReady.push_back( j );
+    }
+    Schedule( pThis, pipeline );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::TaskSample( CDataCollector *pThis, SPipeline& pipeline, const int jobID )
+{
+    const uint64_t timeStart = GetTimeUS();
+    const SCellJob& job = pThis->m_cellJobs[jobID];
+    ProcessJob( pThis, pipeline, job );
+    size_t releasedSize = 0;
+    for( int s = job.sourceID; s < job.sourceID + job.sourceCount; ++s )
+        if( ReleaseSource( *pThis->m_source[s] ) )
+            releasedSize += pThis->m_source[s]->cellSize;
+    const uint64_t timeSampled = GetTimeUS();
+    
+    // The pipeline is not touched after the last job notifies
+    std::lock_guard< std::mutex > lock( pipeline.mtx );
+    --pipeline.taskCount[STAGE_SAMPLE];
+    ++pipeline.stats[STAGE_SAMPLE].taskCount;
+    pipeline.stats[STAGE_SAMPLE].busyTimeUS += timeSampled - timeStart;
+    if( releasedSize > 0 )
+        ReleaseMemory( pipeline.budget, releasedSize );
+    Schedule( pThis, pipeline );
+    if( --pipeline.jobLeft == 0 )
+        pipeline.doneCV.notify_all();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const std::string& CDataCollector::GetSourceFilename( const CDataCollector *pThis, const SSource& source )
+{
+    const SImageData& imageData = pThis->m_imageData[source.imageID];
+    return ( source.tileID >= 0 ) ? imageData.tile[source.tileID].filename : imageData.filename;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::EstimateSource( CDataCollector *pThis, SSource& source )
+{
+    // A source holds the file read into memory, decoder and sampling buffers until it's decoded,
+    // and sampled cells until they are written. Raw rasters are mapped, their pages are file
+    // cache which can be dropped, so they aren't counted. Shared pixel maps are built once
+    // per raster size and aren't counted either.
+    const SImageData& imageData = pThis->m_imageData[source.imageID];
+    const bool bIsTile = ( source.tileID >= 0 );
+    const bool bIsRaw = IsRawImage( imageData.imageType );
+    const int totalCellCount = pThis->m_pData->GetCount();
+    size_t cellCount = totalCellCount;
+    if( bIsTile )
+    {
+        const STileIndex& index = *pThis->m_tileIndex[source.imageID];
+        cellCount = index.cellStart[source.tileID + 1] - index.cellStart[source.tileID];
+    }
+    const bool bIsValue = bIsRaw || ( !bIsTile && IsSingleChannel( imageData ) );
+    const size_t channelCount = IsSingleChannel( imageData ) ? 1 : 3;
+    source.cellSize = cellCount * ( bIsValue ? sizeof( float ) : 3 );
+    source.decodeSize = 0;
+    
+    size_t sizeX = imageData.rawSizeX;
+    size_t sizeY = imageData.rawSizeY;
+    if( !bIsRaw )
+    {
+        // Only the header is read, the size of the raster is the one decoded at the scale
+        const std::string& filename = GetSourceFilename( pThis, source );
+        std::ifstream file( filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate );
+        CRasterReader reader( nullptr );
+        if( !file.is_open() || !reader.Open( filename.c_str(), 0 ) )
+            return;
+        
+        const int sourceSizeX = reader.GetSourceSizeX();
+        const int sourceSizeY = reader.GetSourceSizeY();
+        int scaleShift = 0;
+        if( bIsTile )
+        {
+            const STile& tile = imageData.tile[source.tileID];
+            scaleShift = CalcTileScaleShift( sourceSizeX, sourceSizeY, tile.lonMax - tile.lonMin,
+                                             tile.latMax - tile.latMin, totalCellCount );
+        }
+        else
+            scaleShift = CalcDecodeScaleShift( sourceSizeX, sourceSizeY, totalCellCount );
+        sizeX = ( sourceSizeX + ( 1 << scaleShift ) - 1 ) >> scaleShift;
+        sizeY = ( sourceSizeY + ( 1 << scaleShift ) - 1 ) >> scaleShift;
+        source.decodeSize = static_cast< size_t >( file.tellg() ) + reader.EstimateDecodeSize( scaleShift );
+    }
+    
+    // Buffers of sampling, the larger ones of JPEG and raw
+    if( bIsTile )
+        source.decodeSize += ( cellCount * 3 + ( sizeY + 1 ) * 2 ) * sizeof( int );
+    else if( SAMPLING_MODE_AREA == imageData.samplingMode )
+        source.decodeSize += ( ( sizeX + 1 ) * 2 + cellCount ) * channelCount * sizeof( uint64_t );
+    else if( SAMPLING_MODE_COVERAGE == imageData.samplingMode )
+        source.decodeSize += cellCount * channelCount * sizeof( double );
+    source.sizeX = static_cast< int >( sizeX );
+    source.sizeY = static_cast< int >( sizeY );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::TryAcquireMemory( SMemoryBudget& budget, const int sourceID, const size_t size )
+{
+    if( budget.limit > 0 && budget.used > 0 && budget.used + size > budget.limit )
+    {
+        if( budget.heldBackID != sourceID )
+            ++budget.waitCount;
+        budget.heldBackID = sourceID;
+        return false;
+    }
+    
+    budget.used += size;
+    budget.peak = std::max( budget.peak, budget.used );
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::ReleaseMemory( SMemoryBudget& budget, const size_t size )
+{
+    assert( budget.used >= size );
+    budget.used -= size;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::ReadSource( CDataCollector *pThis, SSource& source )
+{
+    CProfileScope scope( "Read", GetSourceFilename( pThis, source ).c_str() );
+    
+    // Raw rasters are mapped by the decode stage
+    if( IsRawImage( pThis->m_imageData[source.imageID].imageType ) )
+        return true;
+    
+    const std::string& filename = GetSourceFilename( pThis, source );
+    std::ifstream file( filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate );
+    if( !file.is_open() )
+    {
+        std::cout << "Can't read file: " << filename << std::endl;
+        return false;
+    }
+    
+    const std::streamsize size = file.tellg();
+    file.seekg( 0, std::ios::beg );
+    source.fileData.resize( static_cast< size_t >( size ) );
+    file.read( (char*)source.fileData.data(), size );
+    return file.gcount() == size;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::DecodeSource( CDataCollector *pThis, SSource& source )
+{
+    CProfileScope scope( "Decode", GetSourceFilename( pThis, source ).c_str() );
+    const SImageData& imageData = pThis->m_imageData[source.imageID];
+    if( source.tileID >= 0 )
+        return SampleTile( pThis, imageData, source );
+    if( IsRawImage( imageData.imageType ) )
+        return DecodeRaw( pThis, imageData, source );
+    return DecodeImage( pThis, imageData, source );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::OpenReader( CDataCollector *pThis, const SSource& source, CRasterReader& reader )
+{
+    // The file is in memory after the read stage
+    const SImageData& imageData = pThis->m_imageData[source.imageID];
+    const uint64_t fileHash = ( source.tileID >= 0 ) ? imageData.tile[source.tileID].fileHash : imageData.fileHash;
+    if( !source.fileData.empty() )
+        return reader.Open( source.fileData.data(), source.fileData.size(), fileHash );
+    return reader.Open( GetSourceFilename( pThis, source ).c_str(), fileHash );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::DecodeImage( CDataCollector *pThis, const SImageData& imageData, SSource& source )
+{
+    CRasterReader reader( pThis->m_pRasterCache.get() );
+    if( !OpenReader( pThis, source, reader ) )
+        return false;
+    
+    // The mesh may be much coarser than the raster, then blocks are reconstructed by reduced IDCTs
+    const int cellCount = pThis->m_pData->GetCount();
+    const int scaleShift = CalcDecodeScaleShift( reader.GetSourceSizeX(), reader.GetSourceSizeY(), cellCount );
+    if( !reader.Begin( scaleShift ) )
+        return false;
+    
+    if( SAMPLING_MODE_AREA == imageData.samplingMode )
+        return DecodeImageArea( pThis, imageData, reader, source );
+    if( SAMPLING_MODE_COVERAGE == imageData.samplingMode )
+        return DecodeImageCoverage( pThis, imageData, reader, source );
+    
+    const int imageSizeY = reader.GetSizeY();
+    const SPixelMap *pMap = AcquirePixelMap( pThis, reader.GetSizeX(), imageSizeY );
+    
+    // Grayscale lines have 1 byte per pixel, others are RGBA when decoded and RGB when cached
+    const int pixelStride = reader.GetPixelStride();
+    const int greenOffset = ( pixelStride == 1 ) ? 0 : 1;
+    const int blueOffset = ( pixelStride == 1 ) ? 0 : 2;
+    
+    // Gray scale item takes its channel and maps it to values while the row is in cache
+    if( IsSingleChannel( imageData ) )
+    {
+        float grayValue[256];
+        BuildGrayValues( imageData, true, grayValue );
+        const int channelOffset = ( pixelStride == 1 ) ? 0 : imageData.channel;
+        source.cellValue.assign( cellCount, grayValue[0] );
+        float *pValue = source.cellValue.data();
+        for( int y = 0; y < imageSizeY; ++y )
+        {
+            const uint8_t *pLine = nullptr;
+            if( !reader.ReadLine( &pLine ) )
+                return false;
+            
+            const uint8_t *pChannel = pLine + channelOffset;
+            const int rowEnd = pMap->rowStart[y + 1];
+            for( int i = pMap->rowStart[y]; i < rowEnd; ++i )
+                pValue[pMap->cellID[i]] = grayValue[pChannel[pMap->pixelX[i] * pixelStride]];
+        }
+        return true;
+    }
+    
+    // Sample cells of every row as soon as the row is decoded
+    source.cellColor.resize( cellCount * 3 );
+    uint8_t *pColor = source.cellColor.data();
+    for( int y = 0; y < imageSizeY; ++y )
+    {
+        const uint8_t *pLine = nullptr;
+        if( !reader.ReadLine( &pLine ) )
+            return false;
+        
+        const int rowEnd = pMap->rowStart[y + 1];
+        for( int i = pMap->rowStart[y]; i < rowEnd; ++i )
+        {
+            const uint8_t *pPixel = pLine + pMap->pixelX[i] * pixelStride;
+            uint8_t *pCell = pColor + pMap->cellID[i] * 3;
+            pCell[0] = pPixel[0];
+            pCell[1] = pPixel[greenOffset];
+            pCell[2] = pPixel[blueOffset];
+        }
+    }
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::DecodeImageArea( CDataCollector *pThis, const SImageData& imageData, CRasterReader& reader,
+                                      SSource& source )
+{
+    const int imageSizeX = reader.GetSizeX();
+    const int imageSizeY = reader.GetSizeY();
+    const SAreaMap *pMap = AcquireAreaMap( pThis, imageSizeX, imageSizeY );
+    
+    // Gray scale item sums only its channel
+    const bool bIsSingleChannel = IsSingleChannel( imageData );
+    const int pixelStride = reader.GetPixelStride();
+    const int channelCount = ( pixelStride == 1 || bIsSingleChannel ) ? 1 : 3;
+    const int channelOffset = ( pixelStride == 1 ) ? 0 : imageData.channel;
+    const int cellCount = pThis->m_pData->GetCount();
+    
+    // Nodata level of a gray scale item is left out of the sum, an extra plane counts the
+    // other pixels
+    const bool bSkipNoData = bIsSingleChannel && imageData.bHasNoData;
+    const int noDataLevel = bSkipNoData ? static_cast< int >( imageData.noData ) : -1;
+    const int planeCount = channelCount + ( bSkipNoData ? 1 : 0 );
+    
+    // One row of the summed-area table, planar: sat[c * stride + x] is the sum of plane c
+    // over pixels [0, x) of all rows decoded so far. Sums of cells are accumulated modulo
+    // 2^64, so subtracting before adding is fine.
+    const int stride = imageSizeX + 1;
+    std::vector< uint64_t > sat( stride * planeCount, 0 );
+    std::vector< uint64_t > rowPrefix( stride * planeCount, 0 );
+    std::vector< uint64_t > cellSum( cellCount * planeCount, 0 );
+    uint64_t *pSat = sat.data();
+    uint64_t *pRowPrefix = rowPrefix.data();
+    uint64_t *pCellSum = cellSum.data();
+    const int *pSpan = pMap->span.data();
+    
+    for( int y = 0; y < imageSizeY; ++y )
+    {
+        const uint8_t *pLine = nullptr;
+        if( !reader.ReadLine( &pLine ) )
+            return false;
+        
+        // Prefix sums of the row, then add them to the table row. The second loop is
+        // contiguous and gets vectorized.
+        if( bSkipNoData )
+        {
+            uint64_t rowSum = 0;
+            uint64_t rowCount = 0;
+            const uint8_t *pPixel = pLine + channelOffset;
+            uint64_t *pSumPrefix = pRowPrefix + 1;
+            uint64_t *pCountPrefix = pRowPrefix + stride + 1;
+            for( int x = 0; x < imageSizeX; ++x )
+            {
+                const uint8_t level = pPixel[x * pixelStride];
+                const bool bIsValid = ( level != noDataLevel );
+                rowSum += bIsValid ? level : 0;
+                rowCount += bIsValid;
+                pSumPrefix[x] = rowSum;
+                pCountPrefix[x] = rowCount;
+            }
+        }
+        for( int c = 0; c < channelCount && !bSkipNoData; ++c )
+        {
+            uint64_t rowSum = 0;
+            const uint8_t *pPixel = pLine + ( bIsSingleChannel ? channelOffset : c );
+            uint64_t *pPrefix = pRowPrefix + c * stride + 1;
+            for( int x = 0; x < imageSizeX; ++x )
+            {
+                rowSum += pPixel[x * pixelStride];
+                pPrefix[x] = rowSum;
+            }
+        }
+        const int satSize = stride * planeCount;
+        for( int i = 0; i < satSize; ++i )
+            pSat[i] += pRowPrefix[i];
+        
+        // Cells whose footprint ends at this row add their box, cells which start at the
+        // next row subtract it
+        for( int pass = 0; pass < 2; ++pass )
+        {
+            const bool bIsClose = ( 0 == pass );
+            const std::vector< int >& start = bIsClose ? pMap->closeStart : pMap->openStart;
+            const std::vector< int >& cellID = bIsClose ? pMap->closeCellID : pMap->openCellID;
+            for( int i = start[y]; i < start[y + 1]; ++i )
+            {
+                const int id = cellID[i];
+                const int *pCellSpan = pSpan + id * 4;
+                uint64_t *pSum = pCellSum + id * planeCount;
+                for( int c = 0; c < planeCount; ++c )
+                {
+                    const uint64_t *pSatRow = pSat + c * stride;
+                    const uint64_t box = pSatRow[pCellSpan[1]] - pSatRow[pCellSpan[0]] +
+                                         pSatRow[pCellSpan[3]] - pSatRow[pCellSpan[2]];
+                    pSum[c] = bIsClose ? ( pSum[c] + box ) : ( pSum[c] - box );
+                }
+            }
+        }
+    }
+    
+    // Averages, levels of a gray scale item are mapped to values. Cells without valid pixels
+    // get NaN, an average may equal the nodata level and is a value then.
+    if( bIsSingleChannel )
+    {
+        float grayValue[256];
+        BuildGrayValues( imageData, false, grayValue );
+        source.cellValue.resize( cellCount );
+        float *pValue = source.cellValue.data();
+        for( int i = 0; i < cellCount; ++i )
+        {
+            const uint64_t sum = pCellSum[i * planeCount];
+            const uint64_t count = bSkipNoData ? pCellSum[i * planeCount + 1] : pMap->pixelCount[i];
+            pValue[i] = ( count > 0 ) ? grayValue[( sum + count / 2 ) / count] : NAN;
+        }
+        return true;
+    }
+    
+    source.cellColor.resize( cellCount * 3 );
+    uint8_t *pColor = source.cellColor.data();
+    for( int i = 0; i < cellCount; ++i )
+    {
+        const uint64_t count = pMap->pixelCount[i];
+        for( int c = 0; c < 3; ++c )
+        {
+            const uint64_t sum = pCellSum[i * channelCount + ( ( channelCount == 1 ) ? 0 : c )];
+            pColor[i * 3 + c] = static_cast< uint8_t >( ( sum + count / 2 ) / count );
+        }
+    }
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::DecodeImageCoverage( CDataCollector *pThis, const SImageData& imageData, CRasterReader& reader,
+                                          SSource& source )
+{
+    const int imageSizeY = reader.GetSizeY();
+    const CPixelCoverage *pCoverage = AcquireCoverage( pThis, reader.GetSizeX(), imageSizeY, nullptr );
+    if( !pCoverage )
+        return false;
+    
+    // Gray scale item sums only its channel
+    const bool bIsSingleChannel = IsSingleChannel( imageData );
+    const int pixelStride = reader.GetPixelStride();
+    const int channelCount = ( pixelStride == 1 || bIsSingleChannel ) ? 1 : 3;
+    const int channelOffset = ( pixelStride == 1 ) ? 0 : imageData.channel;
+    const int cellCount = pThis->m_pData->GetCount();
+    const SCoverSpan *pSpan = pCoverage->GetSpans();
+    
+    // Weights of the summed pixels go to an extra plane and sums are divided by them, so float
+    // rounding of the normalized weights and nodata holes don't bias the average. Nodata level
+    // of a gray scale item is left out.
+    const bool bSkipNoData = bIsSingleChannel && imageData.bHasNoData;
+    const int noDataLevel = bSkipNoData ? static_cast< int >( imageData.noData ) : -1;
+    const int planeCount = channelCount + 1;
+    
+    // Weighted sparse gather: spans of every row are applied as soon as the row is decoded
+    std::vector< double > cellSum( cellCount * planeCount, 0.0 );
+    for( int y = 0; y < imageSizeY; ++y )
+    {
+        const uint8_t *pLine = nullptr;
+        if( !reader.ReadLine( &pLine ) )
+            return false;
+        
+        const int spanEnd = pCoverage->GetRowSpanStart( y + 1 );
+        for( int i = pCoverage->GetRowSpanStart( y ); i < spanEnd; ++i )
+        {
+            const SCoverSpan& span = pSpan[i];
+            const uint8_t *pPixel = pLine + span.x0 * pixelStride + ( bIsSingleChannel ? channelOffset : 0 );
+            double *pSum = &cellSum[span.cellID * planeCount];
+            if( bSkipNoData )
+            {
+                uint32_t sum = 0;
+                uint32_t validCount = 0;
+                for( int x = 0; x < span.length; ++x )
+                {
+                    const uint8_t level = pPixel[x * pixelStride];
+                    const bool bIsValid = ( level != noDataLevel );
+                    sum += bIsValid ? level : 0;
+                    validCount += bIsValid;
+                }
+                pSum[0] += static_cast< double >( span.weight ) * sum;
+                pSum[1] += static_cast< double >( span.weight ) * validCount;
+                continue;
+            }
+            for( int c = 0; c < channelCount; ++c )
+            {
+                uint32_t sum = 0;
+                for( int x = 0; x < span.length; ++x )
+                    sum += pPixel[x * pixelStride + c];
+                pSum[c] += static_cast< double >( span.weight ) * sum;
+            }
+            pSum[channelCount] += static_cast< double >( span.weight ) * span.length;
+        }
+    }
+    
+    // Cells without valid pixels get NaN
+    if( bIsSingleChannel )
+    {
+        float grayValue[256];
+        BuildGrayValues( imageData, false, grayValue );
+        source.cellValue.resize( cellCount );
+        float *pValue = source.cellValue.data();
+        for( int i = 0; i < cellCount; ++i )
+        {
+            const double weight = cellSum[i * planeCount + 1];
+            const double level = cellSum[i * planeCount] / weight;
+            pValue[i] = ( weight > 0.0 ) ?
+                grayValue[static_cast< int >( std::max( 0.0, std::min( 255.0, floor( level + 0.5 ) ) ) )] : NAN;
+        }
+        return true;
+    }
+    
+    source.cellColor.resize( cellCount * 3 );
+    uint8_t *pColor = source.cellColor.data();
+    for( int i = 0; i < cellCount; ++i )
+        for( int c = 0; c < 3; ++c )
+        {
+            const double weight = cellSum[i * planeCount + channelCount];
+            const double sum = cellSum[i * planeCount + ( ( channelCount == 1 ) ? 0 : c )];
+            const double value = ( weight > 0.0 ) ? sum / weight : 0.0;
+            pColor[i * 3 + c] = static_cast< uint8_t >( std::max( 0.0, std::min( 255.0, floor( value + 0.5 ) ) ) );
+        }
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::DecodeRaw( CDataCollector *pThis, const SImageData& imageData, SSource& source )
+{
+    // Samples are read from the mapped file in place, no raster is copied
+    const int sampleSize = ( IMAGE_TYPE_RAW_INT16 == imageData.imageType ) ? sizeof( int16_t ) : sizeof( float );
+    CRawRaster raster;
+    if( !raster.Open( imageData.filename.c_str(), imageData.rawSizeX, imageData.rawSizeY, sampleSize,
+                      imageData.rawHeaderSize ) )
+        return false;
+    
+    if( SAMPLING_MODE_COVERAGE == imageData.samplingMode &&
+        !AcquireCoverage( pThis, raster.GetSizeX(), raster.GetSizeY(), nullptr ) )
+        return false;
+    
+    if( IMAGE_TYPE_RAW_INT16 == imageData.imageType )
+        SampleRaw< int16_t >( pThis, imageData, raster, source );
+    else
+        SampleRaw< float >( pThis, imageData, raster, source );
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static bool IsByteOrderSwapped( const bool bIsBigEndian )
+{
+    const uint16_t byteOrderProbe = 1;
+    const bool bIsHostBigEndian = ( 0 == *reinterpret_cast< const uint8_t* >( &byteOrderProbe ) );
+    return bIsBigEndian != bIsHostBigEndian;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< typename T >
+static float LoadRawSample( const uint8_t *pSample, const bool bIsSwapped )
+{
+    uint8_t bytes[sizeof( T )];
+    memcpy( bytes, pSample, sizeof( T ) );
+    if( bIsSwapped )
+        std::reverse( bytes, bytes + sizeof( T ) );
+    
+    T sample;
+    memcpy( &sample, bytes, sizeof( T ) );
+    return static_cast< float >( sample );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< typename T >
+void CDataCollector::SampleRaw( CDataCollector *pThis, const SImageData& imageData, const CRawRaster& raster,
+                                SSource& source )
+{
+    const int imageSizeX = raster.GetSizeX();
+    const int imageSizeY = raster.GetSizeY();
+    const int cellCount = pThis->m_pData->GetCount();
+    const bool bIsSwapped = IsByteOrderSwapped( imageData.bIsBigEndian );
+    const bool bHasNoData = imageData.bHasNoData;
+    const float noData = imageData.noData;
+    
+    // Samples equal to nodata and NaNs are skipped, cells without valid samples get NaN
+    source.cellValue.assign( cellCount, NAN );
+    float *pValue = source.cellValue.data();
+    
+    if( SAMPLING_MODE_AREA == imageData.samplingMode )
+    {
+        // The same summed-area table as for JPEG, but of one channel of valid sums and valid counts
+        const SAreaMap *pMap = AcquireAreaMap( pThis, imageSizeX, imageSizeY );
+        const int stride = imageSizeX + 1;
+        std::vector< double > satSum( stride, 0.0 );
+        std::vector< int64_t > satCount( stride, 0 );
+        std::vector< double > cellSum( cellCount, 0.0 );
+        std::vector< int64_t > cellValidCount( cellCount, 0 );
+        const int *pSpan = pMap->span.data();
+        for( int y = 0; y < imageSizeY; ++y )
+        {
+            const uint8_t *pRow = raster.GetRow( y );
+            double rowSum = 0.0;
+            int64_t rowCount = 0;
+            for( int x = 0; x < imageSizeX; ++x )
+            {
+                const float sample = LoadRawSample< T >( pRow + x * sizeof( T ), bIsSwapped );
+                if( !std::isnan( sample ) && !( bHasNoData && sample == noData ) )
+                {
+                    rowSum += sample;
+                    ++rowCount;
+                }
+                satSum[x + 1] += rowSum;
+                satCount[x + 1] += rowCount;
+            }
+            
+            for( int pass = 0; pass < 2; ++pass )
+            {
+                const bool bIsClose = ( 0 == pass );
+                const std::vector< int >& start = bIsClose ? pMap->closeStart : pMap->openStart;
+                const std::vector< int >& cellID = bIsClose ? pMap->closeCellID : pMap->openCellID;
+                const double sign = bIsClose ? 1.0 : -1.0;
+                for( int i = start[y]; i < start[y + 1]; ++i )
+                {
+                    const int id = cellID[i];
+                    const int *pCellSpan = pSpan + id * 4;
+                    const double boxSum = satSum[pCellSpan[1]] - satSum[pCellSpan[0]] +
+                                          satSum[pCellSpan[3]] - satSum[pCellSpan[2]];
+                    const int64_t boxCount = satCount[pCellSpan[1]] - satCount[pCellSpan[0]] +
+                                             satCount[pCellSpan[3]] - satCount[pCellSpan[2]];
+                    cellSum[id] += sign * boxSum;
+                    cellValidCount[id] += bIsClose ? boxCount : -boxCount;
+                }
+            }
+        }
+        
+        for( int i = 0; i < cellCount; ++i )
+            if( cellValidCount[i] > 0 )
+                pValue[i] = static_cast< float >( cellSum[i] / cellValidCount[i] );
+    }
+    else if( SAMPLING_MODE_COVERAGE == imageData.samplingMode )
+    {
+        // Weights of valid samples are summed too, so nodata holes don't pull the average to zero
+        const CPixelCoverage *pCoverage = AcquireCoverage( pThis, imageSizeX, imageSizeY, nullptr );
+        const SCoverSpan *pSpan = pCoverage->GetSpans();
+        std::vector< double > cellSum( cellCount, 0.0 );
+        std::vector< double > cellWeight( cellCount, 0.0 );
+        for( int y = 0; y < imageSizeY; ++y )
+        {
+            const uint8_t *pRow = raster.GetRow( y );
+            const int spanEnd = pCoverage->GetRowSpanStart( y + 1 );
+            for( int i = pCoverage->GetRowSpanStart( y ); i < spanEnd; ++i )
+            {
+                const SCoverSpan& span = pSpan[i];
+                double sum = 0.0;
+                int validCount = 0;
+                for( int x = span.x0; x < span.x0 + span.length; ++x )
+                {
+                    const float sample = LoadRawSample< T >( pRow + x * sizeof( T ), bIsSwapped );
+                    if( !std::isnan( sample ) && !( bHasNoData && sample == noData ) )
+                    {
+                        sum += sample;
+                        ++validCount;
+                    }
+                }
+                cellSum[span.cellID] += static_cast< double >( span.weight ) * sum;
+                cellWeight[span.cellID] += static_cast< double >( span.weight ) * validCount;
+            }
+        }
+        
+        for( int i = 0; i < cellCount; ++i )
+            if( cellWeight[i] > 0.0 )
+                pValue[i] = static_cast< float >( cellSum[i] / cellWeight[i] );
+    }
+    else
+    {
+        const SPixelMap *pMap = AcquirePixelMap( pThis, imageSizeX, imageSizeY );
+        for( int y = 0; y < imageSizeY; ++y )
+        {
+            const uint8_t *pRow = raster.GetRow( y );
+            const int rowEnd = pMap->rowStart[y + 1];
+            for( int i = pMap->rowStart[y]; i < rowEnd; ++i )
+            {
+                const float sample = LoadRawSample< T >( pRow + pMap->pixelX[i] * sizeof( T ), bIsSwapped );
+                if( !( bHasNoData && sample == noData ) )
+                    pValue[pMap->cellID[i]] = sample;
+            }
+        }
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::SampleTile( CDataCollector *pThis, const SImageData& imageData, SSource& source )
+{
+    const STile& tile = imageData.tile[source.tileID];
+    const STileIndex& index = *pThis->m_tileIndex[source.imageID];
+    const int *pCellID = index.cellID.data() + index.cellStart[source.tileID];
+    const int count = index.cellStart[source.tileID + 1] - index.cellStart[source.tileID];
+    TCellColorVec& cellColor = source.cellColor;
+    TCellValueVec& cellValue = source.cellValue;
+    const float lonSpan = tile.lonMax - tile.lonMin;
+    const float latSpan = tile.latMax - tile.latMin;
+    const bool bIsRaw = IsRawImage( imageData.imageType );
+    const bool bIsInt16 = ( IMAGE_TYPE_RAW_INT16 == imageData.imageType );
+    
+    // Raw tiles are mapped, JPEG tiles are decoded at the scale they would have as a part
+    // of a global image
+    CRawRaster raster;
+    CRasterReader reader( pThis->m_pRasterCache.get() );
+    if( bIsRaw )
+    {
+        const int sampleSize = bIsInt16 ? sizeof( int16_t ) : sizeof( float );
+        if( !raster.Open( tile.filename.c_str(), imageData.rawSizeX, imageData.rawSizeY, sampleSize,
+                          imageData.rawHeaderSize ) )
+            return false;
+    }
+    else
+    {
+        if( !OpenReader( pThis, source, reader ) )
+            return false;
+        const int scaleShift = CalcTileScaleShift( reader.GetSourceSizeX(), reader.GetSourceSizeY(), lonSpan, latSpan,
+                                                   pThis->m_pData->GetCount() );
+        if( !reader.Begin( scaleShift ) )
+            return false;
+    }
+    const int sizeX = bIsRaw ? raster.GetSizeX() : reader.GetSizeX();
+    const int sizeY = bIsRaw ? raster.GetSizeY() : reader.GetSizeY();
+    
+    // Pixels under cell centers, cells bucketed by row
+    std::vector< int > pixelX( count );
+    std::vector< int > pixelY( count );
+    std::vector< int > rowStart( sizeY + 1, 0 );
+    for( int i = 0; i < count; ++i )
+    {
+        const STerraData& data = pThis->m_pData->GetData( pCellID[i] );
+        const float lonOffset = fmod( data.angleLon - tile.lonMin + 720.0f, 360.0f );
+        const int x = static_cast< int >( static_cast< float >( sizeX ) * lonOffset / lonSpan );
+        const int y = static_cast< int >( static_cast< float >( sizeY ) * ( tile.latMax - data.angleLat ) / latSpan );
+        pixelX[i] = std::max( 0, std::min( sizeX - 1, x ) );
+        pixelY[i] = std::max( 0, std::min( sizeY - 1, y ) );
+        ++rowStart[pixelY[i] + 1];
+    }
+    for( int y = 0; y < sizeY; ++y )
+        rowStart[y + 1] += rowStart[y];
+    std::vector< int > rowCell( count );
+    std::vector< int > rowPos( rowStart.begin(), rowStart.end() - 1 );
+    for( int i = 0; i < count; ++i )
+        rowCell[rowPos[pixelY[i]]++] = i;
+    
+    if( bIsRaw )
+    {
+        const bool bIsSwapped = IsByteOrderSwapped( imageData.bIsBigEndian );
+        cellValue.assign( count, NAN );
+        for( int y = 0; y < sizeY; ++y )
+        {
+            const uint8_t *pRow = raster.GetRow( y );
+            for( int i = rowStart[y]; i < rowStart[y + 1]; ++i )
+            {
+                const int cell = rowCell[i];
+                const float sample = bIsInt16 ? LoadRawSample< int16_t >( pRow + pixelX[cell] * sizeof( int16_t ), bIsSwapped ) :
+                                                LoadRawSample< float >( pRow + pixelX[cell] * sizeof( float ), bIsSwapped );
+                if( !( imageData.bHasNoData && sample == imageData.noData ) )
+                    cellValue[cell] = sample;
+            }
+        }
+        return true;
+    }
+    
+    // The same pixel layout as of global images. All lines are read, so the tile gets cached.
+    const int pixelStride = reader.GetPixelStride();
+    const int greenOffset = ( pixelStride == 1 ) ? 0 : 1;
+    const int blueOffset = ( pixelStride == 1 ) ? 0 : 2;
+    cellColor.resize( count * 3 );
+    for( int y = 0; y < sizeY; ++y )
+    {
+        const uint8_t *pLine = nullptr;
+        if( !reader.ReadLine( &pLine ) )
+            return false;
+        
+        for( int i = rowStart[y]; i < rowStart[y + 1]; ++i )
+        {
+            const int cell = rowCell[i];
+            const uint8_t *pPixel = pLine + pixelX[cell] * pixelStride;
+            cellColor[cell * 3] = pPixel[0];
+            cellColor[cell * 3 + 1] = pPixel[greenOffset];
+            cellColor[cell * 3 + 2] = pPixel[blueOffset];
+        }
+    }
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const CDataCollector::SPixelMap *CDataCollector::AcquirePixelMap( CDataCollector *pThis, const int sizeX, const int sizeY )
+{
+    std::lock_guard< std::mutex > lock( pThis->m_pixelMapMutex );
+    for( size_t i = 0; i < pThis->m_pixelMap.size(); ++i )
+    {
+        const SPixelMap *pMap = pThis->m_pixelMap[i].get();
+        if( pMap->sizeX == sizeX && pMap->sizeY == sizeY )
+            return pMap;
+    }
+    
+    // Recalc angles of all cells to pixel coordinates
+    std::unique_ptr< SPixelMap > pMap( new SPixelMap( sizeX, sizeY ) );
+    const float maxX = static_cast< float >( sizeX - 1 );
+    const float maxY = static_cast< float >( sizeY - 1 );
+    
+    assert( pThis->m_pData );
+    const int cellCount = pThis->m_pData->GetCount();
+    std::vector< int > cellRow( cellCount );
+    pMap->rowStart.assign( sizeY + 1, 0 );
+    pMap->cellID.resize( cellCount );
+    pMap->pixelX.resize( cellCount );
+    for( int i = 0; i < cellCount; ++i )
+    {
+        const STerraData& data = pThis->m_pData->GetData( i );
         const float coefX = data.angleLon / 360.0f;
         const float coefY = 1.0f - ( ( data.angleLat + 90.0f ) / 180.0f );
         assert( coefX >= 0.0f && coefX <= 1.0f );
         assert( coefY >= 0.0f && coefY <= 1.0f );
-        const int x = static_cast< int >( sizeX * coefX );
-        const int y = static_cast< int >( sizeY * coefY );
-        assert( x >= 0 && x < imageSizeX );
-        assert( y >= 0 && y < imageSizeY );
+        const int x = static_cast< int >( maxX * coefX );
+        const int y = static_cast< int >( maxY * coefY );
+        assert( x >= 0 && x < sizeX );
+        assert( y >= 0 && y < sizeY );
+        cellRow[i] = y;
+        pMap->pixelX[i] = x;
+        ++pMap->rowStart[y + 1];
+    }
+    
+    // Bucket cells by row keeping cell order inside the row
+    for( int y = 0; y < sizeY; ++y )
+        pMap->rowStart[y + 1] += pMap->rowStart[y];
+    
+    std::vector< int > rowPos( pMap->rowStart.begin(), pMap->rowStart.end() - 1 );
+    std::vector< int > cellX( pMap->pixelX );
+    for( int i = 0; i < cellCount; ++i )
+    {
+        const int pos = rowPos[cellRow[i]]++;
+        pMap->cellID[pos] = i;
+        pMap->pixelX[pos] = cellX[i];
+    }
+    
+    pThis->m_pixelMap.push_back( std::move( pMap ) );
+    return pThis->m_pixelMap.back().get();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int LonToPixel( const float lon, const int sizeX )
+{
+    const int x = static_cast< int >( floor( lon / 360.0f * static_cast< float >( sizeX ) ) );
+    return std::max( 0, std::min( sizeX, x ) );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int LatToPixel( const float lat, const int sizeY )
+{
+    const float coefY = 1.0f - ( ( lat + 90.0f ) / 180.0f );
+    const int y = static_cast< int >( floor( coefY * static_cast< float >( sizeY ) ) );
+    return std::max( 0, std::min( sizeY - 1, y ) );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const CDataCollector::SAreaMap *CDataCollector::AcquireAreaMap( CDataCollector *pThis, const int sizeX, const int sizeY )
+{
+    std::lock_guard< std::mutex > lock( pThis->m_pixelMapMutex );
+    for( size_t i = 0; i < pThis->m_areaMap.size(); ++i )
+    {
+        const SAreaMap *pMap = pThis->m_areaMap[i].get();
+        if( pMap->sizeX == sizeX && pMap->sizeY == sizeY )
+            return pMap;
+    }
+    
+    assert( pThis->m_pData );
+    const int cellCount = pThis->m_pData->GetCount();
+    
+    // Cells are close to equal-area, so footprint is a square of the mean cell size
+    const float radToDegCoef = 180.0f / 3.1415926f;
+    const float halfSize = 0.5f * sqrt( 4.0f * 3.1415926f / static_cast< float >( cellCount ) ) * radToDegCoef;
+    
+    std::unique_ptr< SAreaMap > pMap( new SAreaMap( sizeX, sizeY ) );
+    pMap->span.resize( cellCount * 4 );
+    pMap->pixelCount.resize( cellCount );
+    pMap->openStart.assign( sizeY + 1, 0 );
+    pMap->closeStart.assign( sizeY + 1, 0 );
+    std::vector< int > rowA( cellCount );
+    std::vector< int > rowB( cellCount );
+    for( int i = 0; i < cellCount; ++i )
+    {
+        const STerraData& data = pThis->m_pData->GetData( i );
         
-        const int pos = y * imageSizeX + x;
-        const int offset = pos * pixelStride;
-            
-        const uint8_t colR = pBuffer[offset    ];
-        const uint8_t colG = pBuffer[offset + 1];
-        const uint8_t colB = pBuffer[offset + 2];
-            
-        ProcessPixel( pThis, data, imageData, mtx, colR, colG, colB );
+        // Rows. Lat grows upwards, rows grow downwards.
+        const int y0 = LatToPixel( std::min( data.angleLat + halfSize, 90.0f ), sizeY );
+        const int y1 = LatToPixel( std::max( data.angleLat - halfSize, -90.0f ), sizeY );
+        
+        // Spans. Longitude extent grows towards poles and may wrap around.
+        const float cosLat = cos( data.angleLat / radToDegCoef );
+        const float halfLon = ( cosLat * 180.0f > halfSize ) ? ( halfSize / cosLat ) : 180.0f;
+        int *pSpan = &pMap->span[i * 4];
+        if( halfLon >= 180.0f )
+        {
+            pSpan[0] = 0;
+            pSpan[1] = sizeX;
+            pSpan[2] = pSpan[3] = 0;
+        }
+        else
+        {
+            const float lonA = data.angleLon - halfLon;
+            const float lonB = data.angleLon + halfLon;
+            pSpan[0] = LonToPixel( std::max( lonA, 0.0f ), sizeX );
+            pSpan[1] = std::max( pSpan[0] + 1, LonToPixel( std::min( lonB, 360.0f ), sizeX ) + 1 );
+            pSpan[1] = std::min( pSpan[1], sizeX );
+            if( pSpan[0] == sizeX )
+                pSpan[0] = sizeX - 1;
+            pSpan[2] = pSpan[3] = 0;
+            if( lonA < 0.0f )
+            {
+                pSpan[2] = std::max( pSpan[1], LonToPixel( lonA + 360.0f, sizeX ) );
+                pSpan[3] = sizeX;
+            }
+            else if( lonB > 360.0f )
+            {
+                pSpan[2] = 0;
+                pSpan[3] = std::min( pSpan[0], LonToPixel( lonB - 360.0f, sizeX ) + 1 );
+            }
+        }
+        
+        pMap->pixelCount[i] = ( pSpan[1] - pSpan[0] + pSpan[3] - pSpan[2] ) * ( y1 - y0 + 1 );
+        assert( pMap->pixelCount[i] > 0 );
         
-        //const int x = static_cast< int >( static_cast< float >( imageSizeX ) * data.angleLon / 360.0f );
-        //const int y = static_cast< int >( static_cast< float >( imageSizeX ) * data.angleLon / 360.0f );
+        rowA[i] = y0 - 1;
+        rowB[i] = y1;
+        if( y0 > 0 )
+            ++pMap->openStart[y0];
+        ++pMap->closeStart[y1 + 1];
     }
     
-    /*
-    const size_t pixelStride = sizeof( uint8_t ) * 4;
-    for( int y = 0; y < imageSizeY; ++y )
-        for( int x = 0; x < imageSizeX; ++x )
+    // Bucket cells by event row
+    for( int y = 0; y < sizeY; ++y )
+    {
+        pMap->openStart[y + 1] += pMap->openStart[y];
+        pMap->closeStart[y + 1] += pMap->closeStart[y];
+    }
+    pMap->openCellID.resize( pMap->openStart[sizeY] );
+    pMap->closeCellID.resize( pMap->closeStart[sizeY] );
+    
+    std::vector< int > openPos( pMap->openStart.begin(), pMap->openStart.end() - 1 );
+    std::vector< int > closePos( pMap->closeStart.begin(), pMap->closeStart.end() - 1 );
+    for( int i = 0; i < cellCount; ++i )
+    {
+        if( rowA[i] >= 0 )
+            pMap->openCellID[openPos[rowA[i]]++] = i;
+        pMap->closeCellID[closePos[rowB[i]]++] = i;
+    }
+    
+    pThis->m_areaMap.push_back( std::move( pMap ) );
+    return pThis->m_areaMap.back().get();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const CPixelCoverage *CDataCollector::AcquireCoverage( CDataCollector *pThis, const int sizeX, const int sizeY,
+                                                       CThreadPool *pPool )
+{
+    std::lock_guard< std::mutex > lock( pThis->m_pixelMapMutex );
+    for( size_t i = 0; i < pThis->m_coverage.size(); ++i )
+    {
+        const CPixelCoverage *pCoverage = pThis->m_coverage[i].get();
+        if( pCoverage->GetSizeX() == sizeX && pCoverage->GetSizeY() == sizeY )
+            return pCoverage;
+    }
+    
+    // Coverage depends on the face geometry and image size only, so it is cached on disk. The
+    // file keeps the hash of the geometry file, a stale or broken one is rebuilt.
+    const int cellCount = pThis->m_pData->GetCount();
+    const uint64_t geomHash = CalcFileHash( pThis->m_geomFilename.c_str() );
+    char coverFilename[256];
+    snprintf( coverFilename, sizeof( coverFilename ), "GeoidCover_%d_%dx%d.bin", cellCount, sizeX, sizeY );
+    
+    std::unique_ptr< CPixelCoverage > pCoverage( new CPixelCoverage( sizeX, sizeY, geomHash ) );
+    if( !pCoverage->Load( coverFilename, cellCount ) )
+    {
+        std::vector< SVert > triangle;
+        if( !LoadFaceTriangles( pThis->m_geomFilename.c_str(), &triangle ) ||
+            static_cast< int >( triangle.size() ) != cellCount * 3 )
         {
-            const int pos = y * imageSizeX + x;
-            const int offset = pos * pixelStride;
-            
-            const uint8_t colR = pBuffer[offset    ];
-            const uint8_t colG = pBuffer[offset + 1];
-            const uint8_t colB = pBuffer[offset + 2];
-            
-            ProcessPixel( pThis, imageData, mtx, x, y, colR, colG, colB );
+            std::cout << "Can't load face geometry from file: " << pThis->m_geomFilename << std::endl;
+            return nullptr;
+        }
+        
+        std::cout << "Create pixel coverage for " << sizeX << "x" << sizeY << " image(s)..." << std::endl;
+        pCoverage->Create( triangle, pPool );
+        pCoverage->Save( coverFilename );
+    }
+    
+    pThis->m_coverage.push_back( std::move( pCoverage ) );
+    return pThis->m_coverage.back().get();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::ReleaseSource( SSource& source )
+{
+    // The last job of the source frees it
+    if( source.jobLeft.fetch_sub( 1 ) != 1 )
+        return false;
+    
+    TCellColorVec().swap( source.cellColor );
+    TCellValueVec().swap( source.cellValue );
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::ProcessJob( CDataCollector *pThis, SPipeline& pipeline, const SCellJob& job )
+{
+    const SSource& source = *pThis->m_source[job.sourceID];
+    const int rangeCount = static_cast< int >( pipeline.ticket.size() );
+    const std::vector< int >& rangeBound = pThis->m_rangeBound;
+    
+    // Image job writes its range. Tile job writes cells of the tile index, they are
+    // ascending, so the ranges they fall into are written one after another.
+    const bool bIsTile = ( job.rangeID < 0 );
+    const int *pCellID = bIsTile ? pThis->m_tileIndex[source.imageID]->cellID.data() + job.cellBegin : nullptr;
+    const int end = bIsTile ? ( job.cellEnd - job.cellBegin ) : job.cellEnd;
+    int begin = bIsTile ? 0 : job.cellBegin;
+    int rangeID = bIsTile ? 0 : job.rangeID;
+    
+    // Changed bands of every source of the batch, failed sources write nothing
+    TCellKernelVec kernel;
+    for( int s = job.sourceID; s < job.sourceID + job.sourceCount; ++s )
+    {
+        const SSource& batchSource = *pThis->m_source[s];
+        const SImageData *pImageData = &pThis->m_imageData[batchSource.imageID];
+        for( int b = 0; b < pImageData->bandCount && !batchSource.bIsFailed; ++b )
+            if( pImageData[b].bIsChanged )
+            {
+                kernel.push_back( SCellKernel() );
+                PrepareCellKernel( pThis, pImageData[b], batchSource, &kernel.back() );
+            }
+    }
+    
+    do
+    {
+        int rangeEnd = end;
+        if( bIsTile )
+        {
+            while( pCellID[begin] >= rangeBound[rangeID + 1] )
+                ++rangeID;
+            rangeEnd = begin;
+            while( rangeEnd < end && pCellID[rangeEnd] < rangeBound[rangeID + 1] )
+                ++rangeEnd;
+        }
+        
+        // Wait for the turn of the item in this range. Failed sources only pass it.
+        const int item = source.imageID * rangeCount + rangeID;
+        SRangeTicket& ticket = pipeline.ticket[rangeID];
+        std::unique_lock< std::mutex > lock( ticket.mtx );
+        while( ticket.done != pThis->m_rangeTurn[item] )
+            ticket.cv.wait( lock );
+        
+        if( !kernel.empty() )
+        {
+            CProfileScope scope( "Sample", GetSourceFilename( pThis, source ).c_str() );
+            ProcessCells( pThis, kernel, pCellID, begin, rangeEnd );
         }
-    */
+        if( --pThis->m_rangeWriter[item] == 0 )
+        {
+            ++ticket.done;
+            ticket.cv.notify_all();
+        }
+        begin = rangeEnd;
+    }
+    while( begin < end );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::ProcessCells( CDataCollector *pThis, const TCellKernelVec& kernel, const int *pCellID,
+                                   const int sourceBegin, const int sourceEnd )
+{
+    // Kernels of bands and batched images write cells block by block, so cells of a block
+    // are still in cache for the next kernel
+    assert( pThis->m_pData );
+    STerraData *pData = &pThis->m_pData->GetData( 0 );
+    const int kernelCount = static_cast< int >( kernel.size() );
+    const int blockCellCount = ( kernelCount > 1 ) ? g_kernelBlockCellCount : std::max( 1, sourceEnd - sourceBegin );
+    for( int begin = sourceBegin; begin < sourceEnd; begin += blockCellCount )
+    {
+        const int end = std::min( sourceEnd, begin + blockCellCount );
+        for( int k = 0; k < kernelCount; ++k )
+            kernel[k].func( kernel[k], pData, pCellID, begin, end );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CDataCollector::IsSingleChannel( const SImageData& imageData )
+{
+    // Gray scale item without other bands of its image needs one channel of it
+    return IMAGE_TYPE_GRAY_SCALE == imageData.imageType && 1 == imageData.bandCount;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::BuildGrayValues( const SImageData& imageData, const bool bIsNoDataMarked, float *pGrayValue )
+{
+    // Gray levels are scaled into the range once, the nodata level doesn't change the value.
+    // Averages skip nodata pixels beforehand and keep the scaled value of its level.
+    assert( pGrayValue );
+    for( int c = 0; c < 256; ++c )
+    {
+        const float coef = static_cast< float >( c ) / 255.0f;
+        pGrayValue[c] = imageData.rangeMin + ( imageData.rangeMax - imageData.rangeMin ) * coef;
+    }
+    if( imageData.bHasNoData && bIsNoDataMarked )
+        pGrayValue[static_cast< int >( imageData.noData )] = NAN;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::PrepareCellKernel( CDataCollector *pThis, const SImageData& imageData, const SSource& source,
+                                        SCellKernel *pKernel )
+{
+    // The loop is chosen by data type and cell format, so it has no switch
+    static const TCellKernelFunc processFunc[DATA_TYPE_COUNT][CELL_FORMAT_COUNT] =
+    {
+        { ProcessCellsOf< DATA_TYPE_TOPOGRAPHY, CELL_FORMAT_GRAY >,
+          ProcessCellsOf< DATA_TYPE_TOPOGRAPHY, CELL_FORMAT_COLOR >,
+          ProcessCellsOf< DATA_TYPE_TOPOGRAPHY, CELL_FORMAT_VALUE > },
+        { ProcessCellsOf< DATA_TYPE_OCEAN_DEPTH, CELL_FORMAT_GRAY >,
+          ProcessCellsOf< DATA_TYPE_OCEAN_DEPTH, CELL_FORMAT_COLOR >,
+          ProcessCellsOf< DATA_TYPE_OCEAN_DEPTH, CELL_FORMAT_VALUE > },
+        { ProcessCellsOf< DATA_TYPE_POPULATION, CELL_FORMAT_GRAY >,
+          ProcessCellsOf< DATA_TYPE_POPULATION, CELL_FORMAT_COLOR >,
+          ProcessCellsOf< DATA_TYPE_POPULATION, CELL_FORMAT_VALUE > },
+        { ProcessCellsOf< DATA_TYPE_TEMPERATURE_DAY, CELL_FORMAT_GRAY >,
+          ProcessCellsOf< DATA_TYPE_TEMPERATURE_DAY, CELL_FORMAT_COLOR >,
+          ProcessCellsOf< DATA_TYPE_TEMPERATURE_DAY, CELL_FORMAT_VALUE > },
+        { ProcessCellsOf< DATA_TYPE_TEMPERATURE_NIGHT, CELL_FORMAT_GRAY >,
+          ProcessCellsOf< DATA_TYPE_TEMPERATURE_NIGHT, CELL_FORMAT_COLOR >,
+          ProcessCellsOf< DATA_TYPE_TEMPERATURE_NIGHT, CELL_FORMAT_VALUE > },
+        { ProcessCellsOf< DATA_TYPE_TEMPERATURE_SEA, CELL_FORMAT_GRAY >,
+          ProcessCellsOf< DATA_TYPE_TEMPERATURE_SEA, CELL_FORMAT_COLOR >,
+          ProcessCellsOf< DATA_TYPE_TEMPERATURE_SEA, CELL_FORMAT_VALUE > }
+    };
+    
+    assert( pKernel );
+    assert( imageData.dataType >= 0 && imageData.dataType < DATA_TYPE_COUNT );
+    ECellFormat format = CELL_FORMAT_GRAY;
+    if( !source.cellValue.empty() )
+        format = CELL_FORMAT_VALUE;
+    else if( IMAGE_TYPE_COLOR == imageData.imageType )
+        format = CELL_FORMAT_COLOR;
+    assert( CELL_FORMAT_VALUE == format || !source.cellColor.empty() );
+    assert( imageData.dataType < DATA_TYPE_TEMPERATURE_DAY || ( imageData.month >= 0 && imageData.month < 12 ) );
+    pKernel->func = processFunc[imageData.dataType][format];
+    pKernel->month = imageData.month;
+    pKernel->pColor = source.cellColor.data() + ( ( CELL_FORMAT_GRAY == format ) ? imageData.channel : 0 );
+    pKernel->pValue = source.cellValue.data();
+    pKernel->pValidMask = pThis->m_pData->GetValidMask( GetFieldID( imageData ) );
+    pKernel->pLegend = nullptr;
     
-    // Освобождаем память
-    free( pBuffer );
+    // Colours far from every stop of the legend don't change the value
+    if( CELL_FORMAT_COLOR == format )
+    {
+        assert( imageData.legendID >= 0 );
+        pKernel->pLegend = pThis->m_legend[imageData.legendID].get();
+    }
+    
+    if( CELL_FORMAT_GRAY == format )
+        BuildGrayValues( imageData, true, pKernel->grayValue );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int DATA_TYPE, int CELL_FORMAT >
+void CDataCollector::ProcessCellsOf( const SCellKernel& kernel, STerraData *pData, const int *pCellID,
+                                     const int sourceBegin, const int sourceEnd )
+{
+    // Cells take valid values by a select and set their validity bits without a branch per
+    // cell. Words of whole image cells are built in a register, ranges and blocks start at
+    // word bounds. Sampled cell i is cell pCellID[i] of a tile or cell i of a whole image.
+    assert( pCellID || 0 == ( sourceBegin & 63 ) );
+    const int month = kernel.month;
+    const uint8_t *pColor = kernel.pColor;
+    const float *pValue = kernel.pValue;
+    uint64_t *pValidMask = kernel.pValidMask;
+    for( int begin = sourceBegin; begin < sourceEnd; begin += 64 )
+    {
+        const int end = std::min( sourceEnd, begin + 64 );
+        uint64_t word = 0;
+        for( int i = begin; i < end; ++i )
+        {
+            float value = NAN;
+            if( CELL_FORMAT_VALUE == CELL_FORMAT )
+                value = pValue[i];
+            else if( CELL_FORMAT_GRAY == CELL_FORMAT )
+                value = kernel.grayValue[pColor[i * 3]];
+            else
+            {
+                const uint8_t *pCell = pColor + i * 3;
+                float legendValue = 0.0f;
+                if( kernel.pLegend->GetValue( pCell[0], pCell[1], pCell[2], &legendValue ) )
+                    value = legendValue;
+            }
+            
+            const bool bIsValid = !std::isnan( value );
+            const int cellID = pCellID ? pCellID[i] : i;
+            float& field = GetField< DATA_TYPE >( pData[cellID], month );
+            field = bIsValid ? value : field;
+            if( pCellID )
+                pValidMask[cellID >> 6] |= static_cast< uint64_t >( bIsValid ) << ( cellID & 63 );
+            else
+                word |= static_cast< uint64_t >( bIsValid ) << ( i - begin );
+        }
+        if( !pCellID )
+            pValidMask[begin >> 6] |= word;
+    }
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void CDataCollector::ProcessPixel( CDataCollector *pThis,
-                                   STerraData& terraData,
-                                   const SImageData& imageData, std::mutex& mtx,
-                                   const uint8_t colR, const uint8_t colG, const uint8_t colB )
+template< int DATA_TYPE >
+inline float& CDataCollector::GetField( STerraData& terraData, const int month )
 {
-    const bool bIsWhite = ( colR == 255 );
-    const float coef = static_cast< float >( colR ) / 255.0f;
-    switch( imageData.dataType )
+    // The data type is a constant, only its case is left
+    switch( DATA_TYPE )
     {
         // The same things
         case DATA_TYPE_TOPOGRAPHY:
         case DATA_TYPE_OCEAN_DEPTH:
-            {
-                if( bIsWhite )
-                    return;
-                mtx.lock();
-                terraData.height = imageData.rangeMin + ( imageData.rangeMax - imageData.rangeMin ) * coef;
-                mtx.unlock();
-            }
-            break;
+            return terraData.height;
             
         case DATA_TYPE_POPULATION:
-            terraData.population = imageData.rangeMin + ( imageData.rangeMax - imageData.rangeMin ) * coef;
-            break;
+            return terraData.population;
             
         case DATA_TYPE_TEMPERATURE_DAY:
-            assert( imageData.month >= 0 && imageData.month < 12 );
-            terraData.landTempDay[imageData.month] = imageData.rangeMin + ( imageData.rangeMax - imageData.rangeMin ) * coef;
-            terraData.bIsLand = true;
-            terraData.bIsInit = true;
-            break;
+            return terraData.landTempDay[month];
             
         case DATA_TYPE_TEMPERATURE_NIGHT:
-            assert( imageData.month >= 0 && imageData.month < 12 );
-            terraData.landTempNight[imageData.month] = imageData.rangeMin + ( imageData.rangeMax - imageData.rangeMin ) * coef;
-            terraData.bIsLand = true;
-            terraData.bIsInit = true;
-            break;
-            
-        case DATA_TYPE_TEMPERATURE_SEA:
-            assert( imageData.month >= 0 && imageData.month < 12 );
-            terraData.seaTemp[imageData.month] = imageData.rangeMin + ( imageData.rangeMax - imageData.rangeMin ) * coef;
-            terraData.bIsWater = true;
-            terraData.bIsInit = true;
-            break;
+            return terraData.landTempNight[month];
             
         default:
-            std::cout << "Unknown EDataType" << std::endl;
-            break;
+            return terraData.seaTemp[month];
     }
-    
-    //mtx.unlock();
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void CDataCollector::ReportInputDataQueue()
@@ -352,8 +2414,41 @@ void CDataCollector::ReportInputDataQueue()
         printf( "    file:      %s\n", data.filename.c_str() );
         printf( "    imageType: %s\n", GetStringForImageType( data.imageType ) );
         printf( "    dataType:  %s\n", GetStringForDataType( data.dataType ) );
+        printf( "    sampling:  %s\n", GetStringForSamplingMode( data.samplingMode ) );
         printf( "    rangeMin:  %f\n", data.rangeMin );
         printf( "    rangeMax:  %f\n", data.rangeMax );
     }
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::ReportStageStats( const SPipeline& pipeline, const uint64_t totalTimeUS )
+{
+    // Share of the pool time taken by every stage, sample tasks include waiting for turns
+    const int threadCount = m_pPool->GetThreadCount();
+    const double coef = ( totalTimeUS > 0 ) ? 100.0 / ( static_cast< double >( totalTimeUS ) * threadCount ) : 0.0;
+    printf( "\nStage statistics (%d pool thread(s), %d ms):\n", threadCount, (int)( totalTimeUS / 1000 ) );
+    for( int stage = 0; stage < STAGE_COUNT; ++stage )
+    {
+        const SStageStats& stats = pipeline.stats[stage];
+        printf( "\t%-6s: %5d task(s), at most %2d at a time, busy %7d ms, %5.1f%% of the pool\n",
+            m_pStageStr[stage],
+            stats.taskCount,
+            m_stageThreadCount[stage],
+            (int)( stats.busyTimeUS / 1000 ),
+            coef * stats.busyTimeUS );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CDataCollector::ReportMemoryBudget( const SMemoryBudget& budget )
+{
+    if( 0 == budget.limit )
+    {
+        printf( "Memory budget: none, peak estimate %d MB\n", (int)( budget.peak >> 20 ) );
+        return;
+    }
+    
+    printf( "Memory budget: %d MB, peak estimate %d MB, %d source(s) held back\n",
+        (int)( budget.limit >> 20 ),
+        (int)( budget.peak >> 20 ),
+        budget.waitCount );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
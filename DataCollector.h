@@ -10,20 +10,41 @@
 //
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma once
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <condition_variable>
+
+#include "Utils.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 class TiXmlNode;
+class CPixelCoverage;
+class CColorLegend;
+class CRasterCache;
+class CRasterReader;
+class CRawRaster;
+class CThreadPool;
 class CTerraData;
 struct STerraData;
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 class CDataCollector
 {
 public:
-    CDataCollector( CTerraData *pData, const int coreCount );
+    CDataCollector( CTerraData *pData, CThreadPool *pPool );
+    ~CDataCollector();
+    void    SetGeometryFile( const char *pFilenameGeom );
+    void    SetRasterCache( const char *pDirectory, const uint64_t sizeLimit );
+    void    SetStageThreadCount( const int readCount, const int decodeCount, const int sampleCount );
+    void    SetMemoryBudget( const size_t size );
+    void    SetBatchSourceCount( const int count );
+    bool    LoadManifest( const char *pFilename );
     void    Collect( const char *pFilenameXML );
+    void    SaveManifest( const char *pFilename );
 
 private:
     
@@ -31,6 +52,8 @@ private:
     {
         IMAGE_TYPE_GRAY_SCALE,
         IMAGE_TYPE_COLOR,
+        IMAGE_TYPE_RAW_INT16,           // Headerless or simple-header row-major samples in
+        IMAGE_TYPE_RAW_FLOAT32,         // physical units of the data type
         IMAGE_TYPE_COUNT
     };
     
@@ -45,7 +68,30 @@ private:
         DATA_TYPE_COUNT
     };
     
-    // Internal structure to represent inut data
+    enum ESamplingMode
+    {
+        SAMPLING_MODE_NEAREST,          // Pixel under the cell center
+        SAMPLING_MODE_AREA,             // Average over the cell's lat/lon footprint
+        SAMPLING_MODE_COVERAGE,         // Weighted average over pixels covered by the face
+        SAMPLING_MODE_COUNT
+    };
+    
+    // Tile of a mosaic: image covering lon [lonMin, lonMax] and lat [latMin, latMax]
+    struct STile
+    {
+        STile();
+        
+        std::string filename;
+        float       lonMin;
+        float       lonMax;
+        float       latMin;
+        float       latMax;
+        uint64_t    fileHash;
+    };
+    
+    // Internal structure to represent inut data. Tiled item is named by its name attribute
+    // instead of a filename and its hash covers all its tiles. Bands of a packed image are
+    // consecutive items decoded once, by the first of them.
     struct SImageData
     {
         SImageData();
@@ -53,51 +99,320 @@ private:
         std::string filename;
         EImageType  imageType;
         EDataType   dataType;
+        ESamplingMode samplingMode;
         float       rangeMin;
         float       rangeMax;
         int         month;
+        int         channel;        // Channel scaled by gray scale items: 0 - red, 1 - green, 2 - blue
+        int         bandCount;      // Items decoded with this one, 0 - decoded with an earlier item
+        std::string legend;         // Name of legend of colour images
+        int         legendID;
+        uint64_t    legendHash;
+        int         rawSizeX;       // Size and layout of raw rasters
+        int         rawSizeY;
+        int         rawHeaderSize;
+        bool        bIsBigEndian;
+        bool        bHasNoData;     // Raw sample or gray level without data
+        float       noData;
+        std::vector< STile > tile;
+        bool        bIsTiled;
+        uint64_t    fileHash;
+        bool        bIsChanged;     // Has to be sampled in this run
+        bool        bIsFailed;
+    };
+    
+    // Cells bucketed by image row for images of given size. Built once per distinct size and
+    // shared read-only by all images of this size. Cells of row y are in [rowStart[y], rowStart[y + 1]).
+    struct SPixelMap
+    {
+        SPixelMap( const int _sizeX, const int _sizeY );
+        
+        int                 sizeX;
+        int                 sizeY;
+        std::vector< int >  rowStart;
+        std::vector< int >  cellID;
+        std::vector< int >  pixelX;
+    };
+    
+    // Cell footprints for area sampling of images of given size. Footprint is up to two pixel
+    // spans [x0, x1) (two if it wraps around the antimeridian) over rows [y0, y1]. Cells are
+    // bucketed by row y0 - 1, where the summed-area row is subtracted, and by row y1, where
+    // it is added.
+    struct SAreaMap
+    {
+        SAreaMap( const int _sizeX, const int _sizeY );
+        
+        int                 sizeX;
+        int                 sizeY;
+        std::vector< int >  openStart;
+        std::vector< int >  openCellID;
+        std::vector< int >  closeStart;
+        std::vector< int >  closeCellID;
+        std::vector< int >  span;           // 4 per cell: x0a, x1a, x0b, x1b
+        std::vector< int >  pixelCount;
+    };
+    
+    // Sampled cells are written by the decoding worker and read by the sample jobs of all
+    // workers, so their pages are interleaved over NUMA nodes. Temporary buffers of decoding
+    // are first touched by the decoding worker and stay on its node.
+    typedef std::vector< uint8_t, TInterleavedAllocator< uint8_t > > TCellColorVec;
+    typedef std::vector< float, TInterleavedAllocator< float > > TCellValueVec;
+    
+    // Source of the pipeline: a whole image or one tile of a tiled item. Its file is read
+    // into memory, then decoded scanline by scanline and sampled into cells, so only the
+    // sampled RGB of cells is kept, not the whole raster. Raw rasters and gray scale images
+    // of one band are sampled straight to values, NaN is a cell without valid samples. Cells
+    // of a tile are in the order of the tile index. Sampled cells are shared by the cell jobs
+    // of the source.
+    struct SSource
+    {
+        SSource( const int _imageID, const int _tileID );
+        
+        int                     imageID;
+        int                     tileID;
+        int                     jobBegin;   // Cell jobs [jobBegin, jobEnd) of the source
+        int                     jobEnd;
+        std::vector< uint8_t >  fileData;
+        TCellColorVec           cellColor;
+        TCellValueVec           cellValue;
+        size_t                  decodeSize; // Estimated bytes held until decoded
+        size_t                  cellSize;   // Estimated bytes held until all jobs are done
+        int                     sizeX;      // Raster at the decode scale, 0 if the header can't be read
+        int                     sizeY;
+        bool                    bIsFailed;
+        std::atomic< int >      jobLeft;
+    };
+    
+    // Job: range of cells [cellBegin, cellEnd) written from sources [sourceID, sourceID + sourceCount).
+    // Image job writes one cell range from a batch of images, tile job writes cells
+    // [cellBegin, cellEnd) of the tile index range by range from one tile.
+    struct SCellJob
+    {
+        SCellJob( const int _sourceID, const int _sourceCount, const int _rangeID, const int _cellBegin,
+                  const int _cellEnd );
+        
+        int         sourceID;
+        int         sourceCount;
+        int         rangeID;        // -1 for tile jobs
+        int         cellBegin;
+        int         cellEnd;
+    };
+    
+    // Writers of a cell range take turns in the order of items, so items writing the same
+    // field give the same result with any number of threads. The holder of the mutex is the
+    // only writer of the range.
+    struct SRangeTicket
+    {
+        SRangeTicket();
         
-        // Flags
-        bool        bWasStarted;
+        std::mutex              mtx;
+        std::condition_variable cv;
+        int                     done;       // Writers done with the range
+    };
+    
+    // Estimated bytes of sources admitted to the pipeline. Sources are admitted in order while
+    // the total stays under the limit, a source larger than the limit is admitted alone.
+    struct SMemoryBudget
+    {
+        SMemoryBudget( const size_t _limit );
+        
+        const size_t            limit;      // 0 - no limit
+        size_t                  used;
+        size_t                  peak;
+        int                     waitCount;  // Sources held back by the limit
+        int                     heldBackID; // The last source held back
+    };
+    
+    // Cells of a tiled item routed to tiles by their centers. Cells of tile t are
+    // cellID[cellStart[t], cellStart[t + 1]) in ascending order, cells outside of all tiles are left.
+    struct STileIndex
+    {
+        std::vector< int >  cellStart;
+        std::vector< int >  cellID;
+    };
+    
+    // What decode left in the cells of a source
+    enum ECellFormat
+    {
+        CELL_FORMAT_GRAY,               // Gray levels of bands or tiles in their channel of cellColor
+        CELL_FORMAT_COLOR,              // Colour of cellColor mapped by the legend
+        CELL_FORMAT_VALUE,              // Values of cellValue, NaN - no data
+        CELL_FORMAT_COUNT
+    };
+    
+    // Sampling loop of an item and what it needs, prepared once per job
+    struct SCellKernel;
+    typedef void (*TCellKernelFunc)( const SCellKernel& kernel, STerraData *pData, const int *pCellID,
+                                     const int sourceBegin, const int sourceEnd );
+    struct SCellKernel
+    {
+        TCellKernelFunc     func;
+        int                 month;
+        const uint8_t      *pColor;         // Channel of the item in sampled cells
+        const float        *pValue;
+        uint64_t           *pValidMask;     // Validity of the field in terra data
+        const CColorLegend *pLegend;
+        float               grayValue[256]; // Gray level scaled into the range, NaN - no data
+    };
+    
+    enum EStage
+    {
+        STAGE_READ,                     // Source files are read into memory
+        STAGE_DECODE,                   // Decoded and sampled into cells
+        STAGE_SAMPLE,                   // Sampled cells are written to terra data
+        STAGE_COUNT
+    };
+    
+    // Tasks of a stage and the pool time they took
+    struct SStageStats
+    {
+        SStageStats();
+        
+        int         taskCount;
+        uint64_t    busyTimeUS;
     };
     
     // Typedefs
     typedef std::vector< SImageData > TImageVec;
+    typedef std::vector< std::unique_ptr< SPixelMap > > TPixelMapVec;
+    typedef std::vector< std::unique_ptr< SAreaMap > > TAreaMapVec;
+    typedef std::vector< std::unique_ptr< CPixelCoverage > > TCoverageVec;
+    typedef std::vector< std::unique_ptr< SSource > > TSourceVec;
+    typedef std::vector< SCellJob > TCellJobVec;
+    typedef std::vector< SRangeTicket > TTicketVec;
+    typedef std::vector< SCellKernel > TCellKernelVec;
+    
+    // Scheduling state of the stages, guarded by mtx except for the tickets. Sources are
+    // admitted in order, read and decoded in any order, and their cell jobs are released in
+    // the source order. Ready items wait in queues while their stage has its limit of tasks
+    // running, or while the next stage has enough queued.
+    struct SPipeline
+    {
+        SPipeline( const int sourceCount, const int jobCount, const int rangeCount, const size_t memoryLimit );
+        
+        std::mutex              mtx;
+        std::condition_variable doneCV;
+        int                     nextAdmit;      // Next source to read
+        int                     nextRelease;    // Next source to release cell jobs of
+        std::deque< int >       decodeReady;    // Sources read
+        std::deque< int >       sampleReady;    // Cell jobs of released sources
+        std::vector< bool >     bIsDecoded;
+        int                     taskCount[STAGE_COUNT]; // Tasks submitted and not done yet
+        int                     jobLeft;        // Cell jobs not done yet
+        SMemoryBudget           budget;
+        TTicketVec              ticket;
+        SStageStats             stats[STAGE_COUNT];
+    };
+    typedef std::vector< std::unique_ptr< CColorLegend > > TLegendVec;
+    typedef std::vector< std::unique_ptr< STileIndex > > TTileIndexVec;
     //typedef void (*TDataFunc)( const int x, const int y, const uint8_t colR, const uint8_t colG, const uint8_t colB );
     
     // String constants for various types
     static const char *m_pImageTypeStr[IMAGE_TYPE_COUNT];
     static const char *m_pDataTypeStr[DATA_TYPE_COUNT];
+    static const char *m_pSamplingModeStr[SAMPLING_MODE_COUNT];
+    static const char *m_pStageStr[STAGE_COUNT];
     
     // Main working steps
     void        CollectImageData( const char *pFilenameXML );
+    void        CollectLegends( const TiXmlNode *pRoot );
+    void        SelectChangedItems();
+    void        CreateSources();
+    int         CreateCellJobs();
     void        Process();
     
     // Aux methods
     int         GetNodeChildCount( const TiXmlNode *pRoot, const char *pChildName );
+    bool        ParseItem( const TiXmlNode *pNode, SImageData *pData );
+    bool        ParseTiles( const TiXmlNode *pNode, SImageData *pData );
+    bool        ParseBands( const TiXmlNode *pNode, const SImageData& data, TImageVec *pBand );
+    static int  ParseChannel( const char *pChannelStr );
+    static bool ParseNoData( const char *pNoDataStr, SImageData *pData );
+    bool        ParseColor( const char *pColorStr, uint8_t *pCol );
+    int         FindLegend( const std::string& name ) const;
+    static bool IsRawImage( const EImageType type );
+    static bool IsSameItem( const SImageData& a, const SImageData& b );
+    static int  GetFieldID( const SImageData& data );
+    static bool IsInTile( const STile& tile, const float lat, const float lon );
+    std::unique_ptr< STileIndex > CreateTileIndex( const SImageData& data );
     
     // Methods for parsing input data and get string name by its type
     EImageType  ParseImageType( const char *pImageTypeStr );
     EDataType   ParseDataType( const char *pDataTypeStr );
+    ESamplingMode ParseSamplingMode( const char *pSamplingModeStr );
     const char *GetStringForImageType( const EImageType type );
     const char *GetStringForDataType( const EDataType type );
+    const char *GetStringForSamplingMode( const ESamplingMode mode );
     
-    // Thread functions and its parts
-    static void ThreadProcessImage( const int threadID, CDataCollector *pThis,
-                                    std::mutex& jobMutex, std::mutex& dataMutex );
-    static void ProcessImage( CDataCollector *pThis, const SImageData& imageData, std::mutex& mtx );
-    static void ProcessPixel( CDataCollector *pThis,
-                              STerraData& terraData,
-                              const SImageData& imageData, std::mutex& mtx,
-                              const uint8_t colR, const uint8_t colG, const uint8_t colB );
+    // Tasks of pipeline stages and their parts
+    static void Schedule( CDataCollector *pThis, SPipeline& pipeline );
+    static void TaskRead( CDataCollector *pThis, SPipeline& pipeline, const int sourceID );
+    static void TaskDecode( CDataCollector *pThis, SPipeline& pipeline, const int sourceID );
+    static void TaskSample( CDataCollector *pThis, SPipeline& pipeline, const int jobID );
+    static void EstimateSource( CDataCollector *pThis, SSource& source );
+    static bool TryAcquireMemory( SMemoryBudget& budget, const int sourceID, const size_t size );
+    static void ReleaseMemory( SMemoryBudget& budget, const size_t size );
+    static bool ReadSource( CDataCollector *pThis, SSource& source );
+    static bool DecodeSource( CDataCollector *pThis, SSource& source );
+    static const std::string& GetSourceFilename( const CDataCollector *pThis, const SSource& source );
+    static bool OpenReader( CDataCollector *pThis, const SSource& source, CRasterReader& reader );
+    static bool DecodeImage( CDataCollector *pThis, const SImageData& imageData, SSource& source );
+    static bool DecodeImageArea( CDataCollector *pThis, const SImageData& imageData, CRasterReader& reader,
+                                 SSource& source );
+    static bool DecodeImageCoverage( CDataCollector *pThis, const SImageData& imageData, CRasterReader& reader,
+                                     SSource& source );
+    static bool DecodeRaw( CDataCollector *pThis, const SImageData& imageData, SSource& source );
+    template< typename T >
+    static void SampleRaw( CDataCollector *pThis, const SImageData& imageData, const CRawRaster& raster,
+                           SSource& source );
+    static const SPixelMap *AcquirePixelMap( CDataCollector *pThis, const int sizeX, const int sizeY );
+    static const SAreaMap *AcquireAreaMap( CDataCollector *pThis, const int sizeX, const int sizeY );
+    static const CPixelCoverage *AcquireCoverage( CDataCollector *pThis, const int sizeX, const int sizeY,
+                                                  CThreadPool *pPool );
+    static bool SampleTile( CDataCollector *pThis, const SImageData& imageData, SSource& source );
+    static void ProcessJob( CDataCollector *pThis, SPipeline& pipeline, const SCellJob& job );
+    static void ProcessCells( CDataCollector *pThis, const TCellKernelVec& kernel, const int *pCellID,
+                              const int sourceBegin, const int sourceEnd );
+    static bool ReleaseSource( SSource& source );
+    static bool IsSingleChannel( const SImageData& imageData );
+    static void BuildGrayValues( const SImageData& imageData, const bool bIsNoDataMarked, float *pGrayValue );
+    static void PrepareCellKernel( CDataCollector *pThis, const SImageData& imageData, const SSource& source,
+                                   SCellKernel *pKernel );
+    template< int DATA_TYPE, int CELL_FORMAT >
+    static void ProcessCellsOf( const SCellKernel& kernel, STerraData *pData, const int *pCellID,
+                                const int sourceBegin, const int sourceEnd );
+    template< int DATA_TYPE >
+    static float& GetField( STerraData& terraData, const int month );
     
     // Report functions
     void        ReportInputDataQueue();
+    void        ReportStageStats( const SPipeline& pipeline, const uint64_t totalTimeUS );
+    void        ReportMemoryBudget( const SMemoryBudget& budget );
+    
     
     CTerraData *m_pData;
     
     // Data
     TImageVec   m_imageData;
-    const int   m_coreCount;
+    TImageVec   m_manifest;     // Items the loaded data was made of
+    TLegendVec  m_legend;
+    std::vector< std::string > m_legendName;
+    bool        m_bIsManifestLoaded;
+    TSourceVec  m_source;
+    TCellJobVec m_cellJobs;
+    TTileIndexVec m_tileIndex;
+    std::vector< int > m_rangeBound;    // Cell ranges of range tickets
+    std::vector< int > m_rangeTurn;     // Turn of item i in range r: [i * rangeCount + r], -1 if not written
+    std::vector< int > m_rangeWriter;   // Jobs of item i writing range r, the last one passes the turn
+    int         m_stageThreadCount[STAGE_COUNT];    // Tasks of a stage running at a time
+    size_t      m_memoryBudget;     // Bytes sources may hold at a time, 0 - no limit
+    int         m_batchSourceCount; // Images written by one pass over the cells
+    TPixelMapVec m_pixelMap;
+    TAreaMapVec m_areaMap;
+    TCoverageVec m_coverage;
+    std::string m_geomFilename;
+    std::unique_ptr< CRasterCache > m_pRasterCache;
+    std::mutex  m_pixelMapMutex;
+    CThreadPool *m_pPool;
 };
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -5,6 +5,8 @@
 #include <fstream>
 #include <cassert>
 
+#include "Profiler.h"
+#include "ThreadPool.h"
 #include "Utils.h"
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 SVert::SVert() :
@@ -53,10 +55,12 @@ void SVert::Normalize()
 SEdge::SEdge() :
     idA( INVALID_ID ),
     idB( INVALID_ID ),
+    idC( INVALID_ID ),
     faceID{ INVALID_ID, INVALID_ID }
 {}
 ////////////////////////////////////////////////////////////////////////////////////////////////////    
 SEdge::SEdge( const int _idA, const int _idB ) :
+    idC( INVALID_ID ),
     faceID{ INVALID_ID, INVALID_ID }
 {
     const bool bIsABigger = ( _idA > _idB ); 
@@ -82,6 +86,14 @@ bool SEdge::operator==( const SEdge& rhs ) const
 }
 */
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+SFace::SFace() :
+    regionID( INVALID_ID ),
+    pointID{ INVALID_ID, INVALID_ID, INVALID_ID },
+    edgeID{ INVALID_ID, INVALID_ID, INVALID_ID },
+    angleLat( 0.0f ),
+    angleLon( 0.0f )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 SFace::SFace( const int _regionID, const int idA, const int idB, const int idC ) :
     regionID( _regionID ),
     pointID{ idA, idB, idC }
@@ -154,9 +166,19 @@ static int FindEdgeID( const SIcosahedron *pIco, const std::map< SEdge, int >& d
     return it->second;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static void EstablishConnectivity( SIcosahedron *pIco )
+static void ParallelFor( CThreadPool *pPool, const int count, const CThreadPool::TRangeTask& task )
+{
+    // Without a pool the whole range runs on the calling thread
+    if( pPool )
+        pPool->ParallelFor( count, task );
+    else
+        task( 0, count );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void EstablishConnectivity( SIcosahedron *pIco, CThreadPool *pPool )
 {
     assert( pIco );
+    CProfileScope scope( "EstablishConnectivity", pIco->level );
     const int vertCount = static_cast< int >( pIco->vert.size() );
     const int faceCount = static_cast< int >( pIco->face.size() );
     const int edgeCount = static_cast< int >( pIco->edge.size() );
@@ -166,21 +188,28 @@ static void EstablishConnectivity( SIcosahedron *pIco )
     for( int i = 0; i < edgeCount; ++i )
         dict.insert( std::pair< SEdge, int >( pIco->edge[i], i ) );
     
-    // Create connectivity
+    // Find edges of faces, the dictionary is only read
+    ParallelFor( pPool, faceCount, [ pIco, &dict, vertCount, edgeCount ]( const int begin, const int end )
+    {
+        for( int faceID = begin; faceID < end; ++faceID )
+            for( int i = 0; i < 3; ++i )
+            {
+                const int j = ( i + 1 ) % 3;
+                const int idA = pIco->face[faceID].pointID[i];
+                const int idB = pIco->face[faceID].pointID[j];
+                assert( idA >= 0 && idA < vertCount );
+                assert( idB >= 0 && idB < vertCount );
+                const SEdge edge( idA, idB );
+                const int edgeID = FindEdgeID( pIco, dict, edge );
+                assert( edgeID >= 0 && edgeID < edgeCount );
+                pIco->face[faceID].edgeID[i] = edgeID;
+            }
+    } );
+    
+    // Faces are registered in order, so the face order of edges doesn't depend on threads
     for( int faceID = 0; faceID < faceCount; ++faceID )
         for( int i = 0; i < 3; ++i )
-        {
-            const int j = ( i + 1 ) % 3;
-            const int idA = pIco->face[faceID].pointID[i];
-            const int idB = pIco->face[faceID].pointID[j];
-            assert( idA >= 0 && idA < vertCount );
-            assert( idB >= 0 && idB < vertCount );
-            const SEdge edge( idA, idB );
-            const int edgeID = FindEdgeID( pIco, dict, edge );
-            assert( edgeID >= 0 && edgeID < edgeCount );
-            pIco->face[faceID].edgeID[i] = edgeID;
-            pIco->edge[edgeID].RegisterFace( faceID );
-        }
+            pIco->edge[pIco->face[faceID].edgeID[i]].RegisterFace( faceID );
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void NormalizeIcosahedron( SIcosahedron *pIco )
@@ -210,37 +239,38 @@ void CalcCoordinates( SIcosahedron *pIco )
         assert( idB >= 0 && idB < vertCount );
         assert( idC >= 0 && idC < vertCount );
 
-        const SVert& vertA = pIco->vert[idA];
-        const SVert& vertB = pIco->vert[idB];
-        const SVert& vertC = pIco->vert[idC];
-        
-        const SVert middleVert = ( vertA + vertB + vertC );
-        const SVert horizontal( middleVert.x, 0.0f, middleVert.z );
-        const SVert normal = middleVert.GetNormalazed();
-        const SVert equator = horizontal.GetNormalazed();
-
-        const float radToDegCoef = 180.0f / 3.1415926f;
-        const float angleV = 90.0f - acos( normal.y ) * radToDegCoef;
-        const float angleH = acos( equator.x ) * radToDegCoef;
-        
-        face.angleLat = ( normal.y >= 0.0f ) ? angleV : -angleV;
-        face.angleLon = ( equator.z >= 0.0f ) ? ( 180.0f - angleH ) : ( 180.0f + angleH );
-        
-        // Correct longitude angle
-        if( face.angleLon < 0.0f )
-            face.angleLon += 360.0f;
-        
-        assert( face.angleLat >= -90.0f & face.angleLat <= 90.0f );
-        assert( face.angleLon >= 0.0f & face.angleLon <= 360.0f );
-        
-        
-        //printf( "%f\n", face.angleLat );
-        //printf( "%f : %f\n", face.angleLat, face.angleLon );
+        CalcFaceCoordinates( pIco->vert[idA], pIco->vert[idB], pIco->vert[idC], &face );
     }
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+void CalcFaceCoordinates( const SVert& vertA, const SVert& vertB, const SVert& vertC, SFace *pFace )
+{
+    assert( pFace );
+    
+    const SVert middleVert = ( vertA + vertB + vertC );
+    const SVert horizontal( middleVert.x, 0.0f, middleVert.z );
+    const SVert normal = middleVert.GetNormalazed();
+    const SVert equator = horizontal.GetNormalazed();
+
+    const float radToDegCoef = 180.0f / 3.1415926f;
+    // Negative below the equator already
+    const float angleV = 90.0f - acos( normal.y ) * radToDegCoef;
+    const float angleH = acos( equator.x ) * radToDegCoef;
+    
+    pFace->angleLat = angleV;
+    pFace->angleLon = ( equator.z >= 0.0f ) ? ( 180.0f - angleH ) : ( 180.0f + angleH );
+    
+    // Correct longitude angle
+    if( pFace->angleLon < 0.0f )
+        pFace->angleLon += 360.0f;
+    
+    assert( pFace->angleLat >= -90.0f && pFace->angleLat <= 90.0f );
+    assert( pFace->angleLon >= 0.0f && pFace->angleLon <= 360.0f );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 void SaveIcosahedronGeom( const SIcosahedron& ico, const char *pFilename )
 {
+    CProfileScope scope( "SaveGeom", pFilename );
     printf( "\nSaving geometry to %s...\n", pFilename );
     
     const int vertCount = static_cast< int >( ico.vert.size() );
@@ -291,6 +321,7 @@ void SaveIcosahedronGeom( const SIcosahedron& ico, const char *pFilename )
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void SaveIcosahedronData( const SIcosahedron& ico, const char *pFilename )
 {
+    CProfileScope scope( "SaveGeoidData", pFilename );
     printf( "\nSaving geoid data to %s...\n", pFilename );
     
     const int faceCount = static_cast< int >( ico.face.size() );
@@ -316,54 +347,82 @@ void SaveIcosahedronData( const SIcosahedron& ico, const char *pFilename )
     printf( "\tSaving data completed.\n");
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+bool LoadFaceTriangles( const char *pFilename, std::vector< SVert > *pTriangle )
+{
+    assert( pTriangle );
+    
+    std::ifstream file;
+    file.open( pFilename, std::ios::in | std::ios::binary );
+    if( !file.is_open() )
+        return false;
+    
+    // Read header
+    const int vertCount = ReadInt( file );
+    const int edgeCount = ReadInt( file );
+    const int faceCount = ReadInt( file );
+    if( vertCount <= 0 || edgeCount <= 0 || faceCount <= 0 )
+        return false;
+    
+    // Read point positions and edges
+    std::vector< SVert > vert( vertCount );
+    for( int i = 0; i < vertCount; ++i )
+    {
+        vert[i].x = ReadFlt( file );
+        vert[i].y = ReadFlt( file );
+        vert[i].z = ReadFlt( file );
+    }
+    
+    std::vector< SEdge > edge( edgeCount );
+    for( int i = 0; i < edgeCount; ++i )
+    {
+        edge[i].idA = ReadInt24( file );
+        edge[i].idB = ReadInt24( file );
+    }
+    
+    // Restore face points from its edges: edge i goes from point i to point i+1
+    pTriangle->resize( faceCount * 3 );
+    for( int i = 0; i < faceCount; ++i )
+    {
+        const int idEdgeA = ReadInt24( file );
+        const int idEdgeB = ReadInt24( file );
+        ReadInt24( file );
+        if( idEdgeA < 0 || idEdgeA >= edgeCount || idEdgeB < 0 || idEdgeB >= edgeCount )
+            return false;
+        
+        const SEdge& edgeA = edge[idEdgeA];
+        const SEdge& edgeB = edge[idEdgeB];
+        const bool bIsCommonA = ( edgeA.idA == edgeB.idA || edgeA.idA == edgeB.idB );
+        const int idB = bIsCommonA ? edgeA.idA : edgeA.idB;
+        const int idA = bIsCommonA ? edgeA.idB : edgeA.idA;
+        const int idC = ( edgeB.idA == idB ) ? edgeB.idB : edgeB.idA;
+        
+        (*pTriangle)[i * 3    ] = vert[idA];
+        (*pTriangle)[i * 3 + 1] = vert[idB];
+        (*pTriangle)[i * 3 + 2] = vert[idC];
+    }
+    
+    return !file.fail();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 SIcosahedron CreateIcosahedron()
 {
-    const float A = 0.26286500f;
-    const float B = 0.42532500f;
-    const float C = 0.0f;
+    const int vertCount = GetIcoVertCount( 0 );
+    const int faceCount = GetIcoFaceCount( 0 );
+    const int edgeCount = GetIcoEdgeCount( 0 );
     
     SIcosahedron ico;
     ico.level = 0;
-    ico.vert.reserve( 12 );
-    ico.face.reserve( 20 );
-    ico.edge.reserve( 30 );
+    ico.vert.reserve( vertCount );
+    ico.face.reserve( faceCount );
+    ico.edge.reserve( edgeCount );
 
     // Vertexes
-    ico.vert.push_back( SVert( -A,  C,  B ) ); //  0
-    ico.vert.push_back( SVert(  A,  C,  B ) ); //  1
-    ico.vert.push_back( SVert( -A,  C, -B ) ); //  2
-    ico.vert.push_back( SVert(  A,  C, -B ) ); //  3
-    ico.vert.push_back( SVert(  C,  B,  A ) ); //  4
-    ico.vert.push_back( SVert(  C,  B, -A ) ); //  5
-    ico.vert.push_back( SVert(  C, -B,  A ) ); //  6
-    ico.vert.push_back( SVert(  C, -B, -A ) ); //  7
-    ico.vert.push_back( SVert(  B,  A,  C ) ); //  8
-    ico.vert.push_back( SVert( -B,  A,  C ) ); //  9
-    ico.vert.push_back( SVert(  B, -A,  C ) ); // 10
-    ico.vert.push_back( SVert( -B, -A,  C ) ); // 12
+    for( int i = 0; i < vertCount; ++i )
+        ico.vert.push_back( SVert( g_icoBaseVert[i][0], g_icoBaseVert[i][1], g_icoBaseVert[i][2] ) );
     
     // Trianlges. Create and assign regionID
-    int regionID = 0;
-    ico.face.push_back( SFace( regionID++, 0,  6, 1 ) );
-    ico.face.push_back( SFace( regionID++, 0, 11, 6 ) );
-    ico.face.push_back( SFace( regionID++, 1,  4, 0 ) );
-    ico.face.push_back( SFace( regionID++, 1,  8, 4 ) );
-    ico.face.push_back( SFace( regionID++, 1, 10, 8 ) );
-    ico.face.push_back( SFace( regionID++, 2,  5, 3 ) );
-    ico.face.push_back( SFace( regionID++, 2,  9, 5 ) );
-    ico.face.push_back( SFace( regionID++, 2, 11, 9 ) );
-    ico.face.push_back( SFace( regionID++, 3,  7, 2 ) );
-    ico.face.push_back( SFace( regionID++, 3, 10, 7 ) );
-    ico.face.push_back( SFace( regionID++, 4,  8, 5 ) );
-    ico.face.push_back( SFace( regionID++, 4,  9, 0 ) );
-    ico.face.push_back( SFace( regionID++, 5,  8, 3 ) );
-    ico.face.push_back( SFace( regionID++, 5,  9, 4 ) );
-    ico.face.push_back( SFace( regionID++, 6, 10, 1 ) );
-    ico.face.push_back( SFace( regionID++, 6, 11, 7 ) );
-    ico.face.push_back( SFace( regionID++, 7, 10, 6 ) );
-    ico.face.push_back( SFace( regionID++, 7, 11, 2 ) );
-    ico.face.push_back( SFace( regionID++, 8, 10, 3 ) );
-    ico.face.push_back( SFace( regionID++, 9, 11, 0 ) );
+    for( int i = 0; i < faceCount; ++i )
+        ico.face.push_back( SFace( i, g_icoBaseFace[i][0], g_icoBaseFace[i][1], g_icoBaseFace[i][2] ) );
     
     // Assign regionID and create edges
     std::set< SEdge > edgeDict;
@@ -386,85 +445,76 @@ SIcosahedron CreateIcosahedron()
         const SEdge& edge = *it;
         ico.edge.push_back( edge );
     }
-    assert( ico.edge.size() == 30 );
+    assert( static_cast< int >( ico.edge.size() ) == edgeCount );
     
-    EstablishConnectivity( &ico );
+    EstablishConnectivity( &ico, nullptr );
     return ico;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-SIcosahedron SplitIcosahedron( SIcosahedron& oldIco )
+SIcosahedron SplitIcosahedron( SIcosahedron& oldIco, CThreadPool *pPool )
 {
-    const int oldVertCount = static_cast< int >( oldIco.vert.size() );
-    const int oldEdgeCount = static_cast< int >( oldIco.edge.size() );
-    const int oldFaceCount = static_cast< int >( oldIco.face.size() );
-    
-    const int newEdgeCount = oldEdgeCount * 2 + oldFaceCount * 3;
-    const int newFaceCount = oldFaceCount * 4;
-    const int newVertCount = oldVertCount + oldEdgeCount;
-    
+    CProfileScope scope( "SplitIcosahedron", oldIco.level + 1 );
+    const int oldVertCount = GetIcoVertCount( oldIco.level );
+    const int oldEdgeCount = GetIcoEdgeCount( oldIco.level );
+    const int oldFaceCount = GetIcoFaceCount( oldIco.level );
+    assert( oldVertCount == static_cast< int >( oldIco.vert.size() ) );
+    assert( oldEdgeCount == static_cast< int >( oldIco.edge.size() ) );
+    assert( oldFaceCount == static_cast< int >( oldIco.face.size() ) );
+    
+    // Every old edge and face writes its own slots, so they are split in parallel
     SIcosahedron newIco;
-    newIco.vert.reserve( newVertCount );
-    newIco.face.reserve( newFaceCount );
-    newIco.edge.reserve( newEdgeCount );
     newIco.level = oldIco.level + 1;
+    newIco.vert.resize( GetIcoVertCount( newIco.level ) );
+    newIco.face.resize( GetIcoFaceCount( newIco.level ) );
+    newIco.edge.resize( GetIcoEdgeCount( newIco.level ) );
     
     // Copy old vertexes
     for( int i = 0; i < oldVertCount; ++i )
-        newIco.vert.push_back( oldIco.vert[i] );
-        
-    // Calculate middle points of edges
-    for( int i = 0; i < oldEdgeCount; ++i )
-    {
-        SEdge& edge = oldIco.edge[i];
-        edge.idC = static_cast< int >( newIco.vert.size() );
-        const SVert middle = ( oldIco.vert[edge.idA] + oldIco.vert[edge.idB] ) * 0.5f;
-        newIco.vert.push_back( middle );
-    }
+        newIco.vert[i] = oldIco.vert[i];
     
-    // Split old edges: A,B,... -> A1,A2,B1,B2,....
-    for( int i = 0; i < oldEdgeCount; ++i )
+    // Calculate middle points of edges and split old edges: A,B,... -> A1,A2,B1,B2,....
+    ParallelFor( pPool, oldEdgeCount, [ &oldIco, &newIco, oldVertCount ]( const int begin, const int end )
     {
-        const SEdge& edge = oldIco.edge[i];
-        const SEdge edgeA( edge.idA, edge.idC );
-        const SEdge edgeB( edge.idB, edge.idC );
-        newIco.edge.push_back( edgeA );
-        newIco.edge.push_back( edgeB );
-    }
+        for( int i = begin; i < end; ++i )
+        {
+            SEdge& edge = oldIco.edge[i];
+            edge.idC = oldVertCount + i;
+            const SVert& vertA = oldIco.vert[edge.idA];
+            const SVert& vertB = oldIco.vert[edge.idB];
+            newIco.vert[edge.idC] = ( vertA + vertB ) * 0.5f;
+            newIco.edge[i * 2] = SEdge( edge.idA, edge.idC );
+            newIco.edge[i * 2 + 1] = SEdge( edge.idB, edge.idC );
+        }
+    } );
     
     // Add new edges and add new faces
-    for( int i = 0; i < oldFaceCount; ++i )
+    ParallelFor( pPool, oldFaceCount, [ &oldIco, &newIco, oldEdgeCount ]( const int begin, const int end )
     {
-        SFace& oldFace = oldIco.face[i]; 
-        const int idEdgeA = oldFace.edgeID[0];
-        const int idEdgeB = oldFace.edgeID[1];
-        const int idEdgeC = oldFace.edgeID[2];
-        assert( idEdgeA >= 0 && idEdgeA < oldEdgeCount );
-        assert( idEdgeB >= 0 && idEdgeB < oldEdgeCount );
-        assert( idEdgeC >= 0 && idEdgeC < oldEdgeCount );
-        const SEdge& edgeA = oldIco.edge[idEdgeA];
-        const SEdge& edgeB = oldIco.edge[idEdgeB];
-        const SEdge& edgeC = oldIco.edge[idEdgeC];
-        
-        const SFace newFaceA( oldFace.regionID, oldFace.pointID[0], edgeA.idC, edgeC.idC );
-        const SFace newFaceB( oldFace.regionID, oldFace.pointID[1], edgeA.idC, edgeB.idC );
-        const SFace newFaceC( oldFace.regionID, oldFace.pointID[2], edgeB.idC, edgeC.idC );
-        const SFace newFaceD( oldFace.regionID, edgeA.idC, edgeB.idC, edgeC.idC );
-        
-        const SEdge newEdgeA( edgeA.idC, edgeC.idC );
-        const SEdge newEdgeB( edgeA.idC, edgeB.idC );
-        const SEdge newEdgeC( edgeB.idC, edgeC.idC );
-        
-        newIco.face.push_back( newFaceA );
-        newIco.face.push_back( newFaceB );
-        newIco.face.push_back( newFaceC );
-        newIco.face.push_back( newFaceD );
-        
-        newIco.edge.push_back( newEdgeA );
-        newIco.edge.push_back( newEdgeB );
-        newIco.edge.push_back( newEdgeC );
-    }
+        for( int i = begin; i < end; ++i )
+        {
+            const SFace& oldFace = oldIco.face[i];
+            int localID[6];
+            for( int j = 0; j < 3; ++j )
+            {
+                const int idEdge = oldFace.edgeID[j];
+                assert( idEdge >= 0 && idEdge < oldEdgeCount );
+                localID[j] = oldFace.pointID[j];
+                localID[j + 3] = oldIco.edge[idEdge].idC;
+            }
+            
+            for( int j = 0; j < 4; ++j )
+            {
+                const int *pChild = g_icoChildFace[j];
+                newIco.face[i * 4 + j] = SFace( oldFace.regionID, localID[pChild[0]], localID[pChild[1]], localID[pChild[2]] );
+            }
+            
+            SEdge *pEdge = &newIco.edge[oldEdgeCount * 2 + i * 3];
+            for( int j = 0; j < 3; ++j )
+                pEdge[j] = SEdge( localID[g_icoChildEdge[j][0]], localID[g_icoChildEdge[j][1]] );
+        }
+    } );
     
-    EstablishConnectivity( &newIco );
+    EstablishConnectivity( &newIco, pPool );
 
     return newIco;
 }
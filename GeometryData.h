@@ -8,7 +8,66 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 static const int INVALID_ID = -1;
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mesh counts of the icosphere on the given subdivision level
+constexpr int GetIcoVertCount( const int level ) { return 10 * ( 1 << ( 2 * level ) ) + 2; }
+constexpr int GetIcoEdgeCount( const int level ) { return 30 * ( 1 << ( 2 * level ) ); }
+constexpr int GetIcoFaceCount( const int level ) { return 20 * ( 1 << ( 2 * level ) ); }
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Base icosahedron (level 0)
+static constexpr float ICO_BASE_A = 0.26286500f;
+static constexpr float ICO_BASE_B = 0.42532500f;
+static constexpr float ICO_BASE_C = 0.0f;
+static constexpr float g_icoBaseVert[GetIcoVertCount( 0 )][3] =
+{
+    { -ICO_BASE_A,  ICO_BASE_C,  ICO_BASE_B }, //  0
+    {  ICO_BASE_A,  ICO_BASE_C,  ICO_BASE_B }, //  1
+    { -ICO_BASE_A,  ICO_BASE_C, -ICO_BASE_B }, //  2
+    {  ICO_BASE_A,  ICO_BASE_C, -ICO_BASE_B }, //  3
+    {  ICO_BASE_C,  ICO_BASE_B,  ICO_BASE_A }, //  4
+    {  ICO_BASE_C,  ICO_BASE_B, -ICO_BASE_A }, //  5
+    {  ICO_BASE_C, -ICO_BASE_B,  ICO_BASE_A }, //  6
+    {  ICO_BASE_C, -ICO_BASE_B, -ICO_BASE_A }, //  7
+    {  ICO_BASE_B,  ICO_BASE_A,  ICO_BASE_C }, //  8
+    { -ICO_BASE_B,  ICO_BASE_A,  ICO_BASE_C }, //  9
+    {  ICO_BASE_B, -ICO_BASE_A,  ICO_BASE_C }, // 10
+    { -ICO_BASE_B, -ICO_BASE_A,  ICO_BASE_C }  // 11
+};
+static constexpr int g_icoBaseFace[GetIcoFaceCount( 0 )][3] =
+{
+    { 0,  6, 1 }, { 0, 11, 6 }, { 1,  4, 0 }, { 1,  8, 4 }, { 1, 10, 8 },
+    { 2,  5, 3 }, { 2,  9, 5 }, { 2, 11, 9 }, { 3,  7, 2 }, { 3, 10, 7 },
+    { 4,  8, 5 }, { 4,  9, 0 }, { 5,  8, 3 }, { 5,  9, 4 }, { 6, 10, 1 },
+    { 6, 11, 7 }, { 7, 10, 6 }, { 7, 11, 2 }, { 8, 10, 3 }, { 9, 11, 0 }
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Split pattern of one face. Local point indices: 0..2 - face points, 3..5 - middle points of
+// face edges 0..2 (edge i goes from point i to point i+1).
+static constexpr int g_icoChildFace[4][3] =
+{
+    { 0, 3, 5 },
+    { 1, 3, 4 },
+    { 2, 4, 5 },
+    { 3, 4, 5 }
+};
+// New inner edges of the split face
+static constexpr int g_icoChildEdge[3][2] =
+{
+    { 3, 5 },
+    { 3, 4 },
+    { 4, 5 }
+};
+// Edges of child faces: 0..2 - half of parent's edge adjacent to the child's first point,
+// 3..5 - inner edge from g_icoChildEdge
+static constexpr int g_icoChildFaceEdge[4][3] =
+{
+    { 0, 3, 2 },
+    { 0, 4, 1 },
+    { 1, 5, 2 },
+    { 4, 5, 3 }
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
 struct SFace;
+class CThreadPool;
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 struct SVert
 {
@@ -41,9 +100,10 @@ struct SEdge
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 struct SFace
 {
+    SFace();
     SFace( const int _regionID, const int idA, const int idB, const int idC );
     
-    const int   regionID;
+    int         regionID;
     int         pointID[3];
     int         edgeID[3];
     
@@ -66,8 +126,10 @@ void            ReportIcosahedron( const SIcosahedron& ico );
 void            CheckIcosahedron( const SIcosahedron& ico );
 void            NormalizeIcosahedron( SIcosahedron *pIco );
 void            CalcCoordinates( SIcosahedron *pIco );
+void            CalcFaceCoordinates( const SVert& vertA, const SVert& vertB, const SVert& vertC, SFace *pFace );
 void            SaveIcosahedronGeom( const SIcosahedron& ico, const char *pFilename );
 void            SaveIcosahedronData( const SIcosahedron& ico, const char *pFilename );
+bool            LoadFaceTriangles( const char *pFilename, std::vector< SVert > *pTriangle );
 SIcosahedron    CreateIcosahedron();
-SIcosahedron    SplitIcosahedron( SIcosahedron& oldIco );
+SIcosahedron    SplitIcosahedron( SIcosahedron& oldIco, CThreadPool *pPool );
 ////////////////////////////////////////////////////////////////////////////////////////////////////
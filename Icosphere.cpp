@@ -0,0 +1,73 @@
+#include "Icosphere.h"
+
+#include <cstdio>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static bool IsSameVert( const SVert& a, const SVert& b )
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static bool IsSameEdge( const SEdge& a, const SEdge& b )
+{
+    return a.idA == b.idA && a.idB == b.idB && a.idC == b.idC &&
+           a.faceID[0] == b.faceID[0] && a.faceID[1] == b.faceID[1];
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static bool IsSameFace( const SFace& a, const SFace& b )
+{
+    bool bIsSame = ( a.regionID == b.regionID );
+    for( int i = 0; i < 3; ++i )
+        bIsSame = bIsSame && a.pointID[i] == b.pointID[i] && a.edgeID[i] == b.edgeID[i];
+    return bIsSame;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int Level >
+static bool CheckLevel( const SIcosahedron& ico )
+{
+    // Storage is several megabytes, so the mesh is kept in static storage
+    typedef TIcosphere< Level > TSphere;
+    static TSphere sphere;
+    sphere.Create();
+    
+    if( static_cast< int >( ico.vert.size() ) != TSphere::VERT_COUNT ||
+        static_cast< int >( ico.edge.size() ) != TSphere::EDGE_COUNT ||
+        static_cast< int >( ico.face.size() ) != TSphere::FACE_COUNT )
+        return false;
+    
+    for( int i = 0; i < TSphere::VERT_COUNT; ++i )
+        if( !IsSameVert( sphere.vert[i], ico.vert[i] ) )
+            return false;
+    for( int i = 0; i < TSphere::EDGE_COUNT; ++i )
+        if( !IsSameEdge( sphere.edge[i], ico.edge[i] ) )
+            return false;
+    for( int i = 0; i < TSphere::FACE_COUNT; ++i )
+        if( !IsSameFace( sphere.face[i], ico.face[i] ) )
+            return false;
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CheckIcosphere( const SIcosahedron& ico )
+{
+    bool bIsSame = true;
+    switch( ico.level )
+    {
+        case 4:
+            bIsSame = CheckLevel< 4 >( ico );
+            break;
+        case 5:
+            bIsSame = CheckLevel< 5 >( ico );
+            break;
+        case 6:
+            bIsSame = CheckLevel< 6 >( ico );
+            break;
+        default:
+            return true;
+    }
+    
+    if( !bIsSame )
+        printf( "\tFixed level icosphere doesn't match the mesh of level %d\n", ico.level );
+    return bIsSame;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,208 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Icosphere of fixed subdivision level. All sizes are compile-time constants and storage lives
+// in std::array, so building the mesh makes no heap allocations. Storage of levels 4-6 is several
+// megabytes, so keep instances in static storage, not on the stack.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <array>
+#include <cassert>
+#include <type_traits>
+
+#include "GeometryData.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int Level >
+struct TIcosphere
+{
+    static_assert( Level >= 0 && Level <= 10, "Unsupported icosphere level" );
+    
+    static constexpr int LEVEL = Level;
+    static constexpr int VERT_COUNT = GetIcoVertCount( Level );
+    static constexpr int EDGE_COUNT = GetIcoEdgeCount( Level );
+    static constexpr int FACE_COUNT = GetIcoFaceCount( Level );
+    
+    void    Create();
+    void    Normalize();
+    void    CalcCoordinates();
+    
+    std::array< SVert, VERT_COUNT > vert;
+    std::array< SEdge, EDGE_COUNT > edge;
+    std::array< SFace, FACE_COUNT > face;
+    
+private:
+    
+    typedef std::integral_constant< int, 0 > TLevelZero;
+    
+    void            CreateLevel( TLevelZero );
+    template< int K >
+    void            CreateLevel( std::integral_constant< int, K > );
+    template< int K >
+    void            SplitLevel();
+    template< int K >
+    void            RegisterFaces();
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int Level >
+void TIcosphere< Level >::Create()
+{
+    CreateLevel( std::integral_constant< int, Level >() );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int Level >
+void TIcosphere< Level >::Normalize()
+{
+    for( int i = 0; i < VERT_COUNT; ++i )
+        vert[i].Normalize();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int Level >
+void TIcosphere< Level >::CalcCoordinates()
+{
+    for( int i = 0; i < FACE_COUNT; ++i )
+    {
+        SFace& f = face[i];
+        CalcFaceCoordinates( vert[f.pointID[0]], vert[f.pointID[1]], vert[f.pointID[2]], &f );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int Level >
+void TIcosphere< Level >::CreateLevel( TLevelZero )
+{
+    const int vertCount = GetIcoVertCount( 0 );
+    const int edgeCount = GetIcoEdgeCount( 0 );
+    const int faceCount = GetIcoFaceCount( 0 );
+    
+    for( int i = 0; i < vertCount; ++i )
+        vert[i] = SVert( g_icoBaseVert[i][0], g_icoBaseVert[i][1], g_icoBaseVert[i][2] );
+    
+    for( int i = 0; i < faceCount; ++i )
+        face[i] = SFace( i, g_icoBaseFace[i][0], g_icoBaseFace[i][1], g_icoBaseFace[i][2] );
+    
+    // Collect unique edges sorted the same way as std::set in CreateIcosahedron
+    int count = 0;
+    for( int i = 0; i < faceCount; ++i )
+        for( int j = 0; j < 3; ++j )
+        {
+            const SEdge newEdge( face[i].pointID[j], face[i].pointID[( j + 1 ) % 3] );
+            int pos = 0;
+            while( pos < count && edge[pos] < newEdge )
+                ++pos;
+            if( pos < count && !( newEdge < edge[pos] ) )
+                continue;
+            for( int k = count; k > pos; --k )
+                edge[k] = edge[k - 1];
+            edge[pos] = newEdge;
+            ++count;
+        }
+    assert( count == edgeCount );
+    
+    // Connectivity
+    for( int i = 0; i < faceCount; ++i )
+        for( int j = 0; j < 3; ++j )
+        {
+            const SEdge faceEdge( face[i].pointID[j], face[i].pointID[( j + 1 ) % 3] );
+            int pos = 0;
+            while( edge[pos] < faceEdge )
+                ++pos;
+            assert( pos < edgeCount );
+            face[i].edgeID[j] = pos;
+        }
+    RegisterFaces< 0 >();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int Level >
+template< int K >
+void TIcosphere< Level >::CreateLevel( std::integral_constant< int, K > )
+{
+    CreateLevel( std::integral_constant< int, K - 1 >() );
+    SplitLevel< K >();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Split level K-1 into level K in place. Vertex, edge and face order is the same as in
+// SplitIcosahedron, so the result matches the runtime mesh. Faces and edges are rewritten
+// from the back because parent i expands into children starting at 4 * i and 2 * i.
+template< int Level >
+template< int K >
+void TIcosphere< Level >::SplitLevel()
+{
+    constexpr int oldVertCount = GetIcoVertCount( K - 1 );
+    constexpr int oldEdgeCount = GetIcoEdgeCount( K - 1 );
+    constexpr int oldFaceCount = GetIcoFaceCount( K - 1 );
+    
+    // Middle points of edges
+    for( int i = 0; i < oldEdgeCount; ++i )
+    {
+        SEdge& e = edge[i];
+        e.idC = oldVertCount + i;
+        const SVert& vertA = vert[e.idA];
+        const SVert& vertB = vert[e.idB];
+        vert[oldVertCount + i] = ( vertA + vertB ) * 0.5f;
+    }
+    
+    // Faces and inner edges. Old edges are still in place here.
+    for( int i = oldFaceCount - 1; i >= 0; --i )
+    {
+        const SFace oldFace = face[i];
+        int localID[6];
+        for( int j = 0; j < 3; ++j )
+        {
+            localID[j] = oldFace.pointID[j];
+            localID[j + 3] = edge[oldFace.edgeID[j]].idC;
+        }
+        
+        for( int j = 0; j < 3; ++j )
+            edge[oldEdgeCount * 2 + i * 3 + j] = SEdge( localID[g_icoChildEdge[j][0]], localID[g_icoChildEdge[j][1]] );
+        
+        for( int j = 0; j < 4; ++j )
+        {
+            const int *pChild = g_icoChildFace[j];
+            SFace newFace( oldFace.regionID, localID[pChild[0]], localID[pChild[1]], localID[pChild[2]] );
+            for( int k = 0; k < 3; ++k )
+            {
+                const int childEdge = g_icoChildFaceEdge[j][k];
+                if( childEdge >= 3 )
+                    newFace.edgeID[k] = oldEdgeCount * 2 + i * 3 + childEdge - 3;
+                else
+                {
+                    const int oldEdgeID = oldFace.edgeID[childEdge];
+                    const bool bIsFirstHalf = ( edge[oldEdgeID].idA == newFace.pointID[0] );
+                    newFace.edgeID[k] = oldEdgeID * 2 + ( bIsFirstHalf ? 0 : 1 );
+                }
+            }
+            face[i * 4 + j] = newFace;
+        }
+    }
+    
+    // Split old edges: A,B,... -> A1,A2,B1,B2,....
+    for( int i = oldEdgeCount - 1; i >= 0; --i )
+    {
+        const SEdge oldEdge = edge[i];
+        edge[i * 2 + 1] = SEdge( oldEdge.idB, oldEdge.idC );
+        edge[i * 2] = SEdge( oldEdge.idA, oldEdge.idC );
+    }
+    
+    RegisterFaces< K >();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< int Level >
+template< int K >
+void TIcosphere< Level >::RegisterFaces()
+{
+    constexpr int edgeCount = GetIcoEdgeCount( K );
+    constexpr int faceCount = GetIcoFaceCount( K );
+    
+    for( int i = 0; i < edgeCount; ++i )
+    {
+        edge[i].faceID[0] = INVALID_ID;
+        edge[i].faceID[1] = INVALID_ID;
+    }
+    
+    for( int i = 0; i < faceCount; ++i )
+        for( int j = 0; j < 3; ++j )
+            edge[face[i].edgeID[j]].RegisterFace( i );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Builds the fixed-level icosphere of the runtime mesh level if it is one of levels 4-6 and
+// compares the meshes. Other levels are not checked and pass.
+bool CheckIcosphere( const SIcosahedron& ico );
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,184 @@
+#include "PerfCounters.h"
+
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <iostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const char *g_pCounterName[CPerfCounters::COUNTER_COUNT] =
+{
+    "cycles",
+    "instructions",
+    "cache-misses",
+    "branch-misses",
+    "node-load-misses"
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static std::atomic< bool >  g_bIsPerfEnabled( false );
+static std::atomic< int >   g_availableMask( -1 );      // Counters opened by the first group, -1 - not tried yet
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifdef __linux__
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const uint32_t g_counterType[CPerfCounters::COUNTER_COUNT] =
+{
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HW_CACHE
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const uint64_t g_counterConfig[CPerfCounters::COUNTER_COUNT] =
+{
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_NODE | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 )
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Counters of one thread read together. Cycles lead the group, others which the CPU
+// doesn't have are left out, position is their place in the group read.
+struct SPerfGroup
+{
+    SPerfGroup();
+    ~SPerfGroup();
+    
+    bool    Open();
+    
+    int     fd[CPerfCounters::COUNTER_COUNT];
+    int     position[CPerfCounters::COUNTER_COUNT];
+    int     memberCount;
+    bool    bIsOpened;
+    bool    bIsFailed;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static thread_local SPerfGroup g_perfGroup;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+SPerfGroup::SPerfGroup() :
+    memberCount( 0 ),
+    bIsOpened( false ),
+    bIsFailed( false )
+{
+    for( int i = 0; i < CPerfCounters::COUNTER_COUNT; ++i )
+    {
+        fd[i] = -1;
+        position[i] = -1;
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+SPerfGroup::~SPerfGroup()
+{
+    for( int i = 0; i < CPerfCounters::COUNTER_COUNT; ++i )
+        if( fd[i] >= 0 )
+            close( fd[i] );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool SPerfGroup::Open()
+{
+    assert( !bIsOpened );
+    bIsOpened = true;
+    
+    // User space of the calling thread on any CPU. Kernel time is left out, so it works
+    // with perf_event_paranoid 2.
+    int mask = 0;
+    for( int i = 0; i < CPerfCounters::COUNTER_COUNT; ++i )
+    {
+        perf_event_attr attr;
+        memset( &attr, 0, sizeof( attr ) );
+        attr.size = sizeof( attr );
+        attr.type = g_counterType[i];
+        attr.config = g_counterConfig[i];
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        
+        const int groupFD = fd[CPerfCounters::COUNTER_CYCLES];
+        fd[i] = static_cast< int >( syscall( __NR_perf_event_open, &attr, 0, -1, groupFD, PERF_FLAG_FD_CLOEXEC ) );
+        if( fd[i] < 0 )
+        {
+            if( CPerfCounters::COUNTER_CYCLES == i )
+            {
+                int expected = -1;
+                if( g_availableMask.compare_exchange_strong( expected, 0 ) )
+                    std::cout << "Hardware counters are unavailable: " << strerror( errno ) << std::endl;
+                bIsFailed = true;
+                return false;
+            }
+            continue;
+        }
+        
+        position[i] = memberCount++;
+        mask |= 1 << i;
+    }
+    
+    int expected = -1;
+    g_availableMask.compare_exchange_strong( expected, mask );
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#endif
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPerfCounters::Enable()
+{
+    g_bIsPerfEnabled = true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CPerfCounters::IsEnabled()
+{
+    return g_bIsPerfEnabled.load( std::memory_order_relaxed );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CPerfCounters::Read( uint64_t *pValue )
+{
+    assert( pValue );
+    memset( pValue, 0, sizeof( uint64_t ) * COUNTER_COUNT );
+
+#ifdef __linux__
+    SPerfGroup& group = g_perfGroup;
+    if( !group.bIsOpened )
+        group.Open();
+    if( group.bIsFailed )
+        return false;
+    
+    // Group read: member count, time enabled, time running, then values in the group order
+    uint64_t data[3 + COUNTER_COUNT];
+    const ssize_t size = read( group.fd[COUNTER_CYCLES], data, sizeof( data ) );
+    if( size < static_cast< ssize_t >( sizeof( uint64_t ) * ( 3 + group.memberCount ) ) )
+        return false;
+    
+    // The group was multiplexed with other events for a part of the time
+    const double scale = ( data[2] > 0 ) ? static_cast< double >( data[1] ) / data[2] : 0.0;
+    for( int i = 0; i < COUNTER_COUNT; ++i )
+        if( group.position[i] >= 0 )
+            pValue[i] = static_cast< uint64_t >( data[3 + group.position[i]] * scale );
+    return true;
+#else
+    int expected = -1;
+    if( g_availableMask.compare_exchange_strong( expected, 0 ) )
+        std::cout << "Hardware counters are unavailable: perf_event_open is Linux only" << std::endl;
+    return false;
+#endif
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CPerfCounters::IsAvailable( const ECounter counter )
+{
+    assert( counter >= 0 && counter < COUNTER_COUNT );
+    const int mask = g_availableMask.load();
+    return mask > 0 && ( mask & ( 1 << counter ) ) != 0;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char *CPerfCounters::GetName( const ECounter counter )
+{
+    assert( counter >= 0 && counter < COUNTER_COUNT );
+    return g_pCounterName[counter];
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
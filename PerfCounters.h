@@ -0,0 +1,38 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  PerfCounters.h
+//  GeoData
+//
+//  Class CPerfCounters: hardware counters of the calling thread via perf_event_open
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstdint>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Linux only. Every thread opens its own counter group on the first read. Where the kernel
+// doesn't give counters (other systems, perf_event_paranoid, containers, VMs) they are
+// reported once as unavailable and read as zeros.
+class CPerfCounters
+{
+public:
+    enum ECounter
+    {
+        COUNTER_CYCLES,
+        COUNTER_INSTRUCTIONS,
+        COUNTER_CACHE_MISSES,
+        COUNTER_BRANCH_MISSES,
+        COUNTER_NODE_MISSES,            // Loads served by another NUMA node
+        COUNTER_COUNT
+    };
+    
+    static void         Enable();
+    static bool         IsEnabled();
+    
+    // Counts of the calling thread since its group was opened, scaled if counters were
+    // multiplexed. Returns false if the group is unavailable.
+    static bool         Read( uint64_t *pValue );
+    static bool         IsAvailable( const ECounter counter );
+    static const char  *GetName( const ECounter counter );
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
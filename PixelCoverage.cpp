@@ -0,0 +1,400 @@
+#include "PixelCoverage.h"
+
+#include <cmath>
+#include <fstream>
+#include <cassert>
+#include <algorithm>
+
+#include "GeometryData.h"
+#include "ThreadPool.h"
+#include "Utils.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const int    g_subSampleCount = 4;   // Sub-samples per pixel side
+static const int    g_rangePerThread = 4;   // Face ranges rasterized for every pool thread
+static const float  g_radToDegCoef = 180.0f / 3.1415926f;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static float Dot( const SVert& a, const SVert& b )
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static SVert Cross( const SVert& a, const SVert& b )
+{
+    return SVert( a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static bool IsLess( const SVert& a, const SVert& b )
+{
+    if( a.x != b.x )
+        return a.x < b.x;
+    if( a.y != b.y )
+        return a.y < b.y;
+    return a.z < b.z;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static float GetLat( const SVert& v )
+{
+    return asin( std::max( -1.0f, std::min( 1.0f, v.y ) ) ) * g_radToDegCoef;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Inverse of CalcFaceCoordinates: direction is ( -cos( lon ), tan( lat ), sin( lon ) ) scaled
+static float GetLon( const SVert& v )
+{
+    const float lon = atan2( v.z, -v.x ) * g_radToDegCoef;
+    return ( lon < 0.0f ) ? ( lon + 360.0f ) : lon;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Spherical triangle as three great circle half-spaces. Points on a shared edge go to exactly
+// one of the two faces: neighbour face has the same edge in opposite direction, so its plane
+// normal is exactly negated and the tie breaking is reversed.
+struct SSphereTriangle
+{
+    SSphereTriangle( SVert a, SVert b, SVert c )
+    {
+        const SVert sum = a + b + c;
+        if( Dot( Cross( SVert( b.x - a.x, b.y - a.y, b.z - a.z ), SVert( c.x - a.x, c.y - a.y, c.z - a.z ) ), sum ) < 0.0f )
+            std::swap( b, c );
+        
+        const SVert *pVert[3] = { &a, &b, &c };
+        for( int i = 0; i < 3; ++i )
+        {
+            const SVert& vertA = *pVert[i];
+            const SVert& vertB = *pVert[( i + 1 ) % 3];
+            normal[i] = Cross( vertA, vertB );
+            bIsTieInside[i] = IsLess( vertA, vertB );
+        }
+    }
+    
+    bool IsInside( const SVert& p ) const
+    {
+        for( int i = 0; i < 3; ++i )
+        {
+            const float side = Dot( normal[i], p );
+            if( side < 0.0f || ( side == 0.0f && !bIsTieInside[i] ) )
+                return false;
+        }
+        return true;
+    }
+    
+    SVert   normal[3];
+    bool    bIsTieInside[3];
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CPixelCoverage::CPixelCoverage( const int sizeX, const int sizeY, const uint64_t geomHash ) :
+    m_sizeX( sizeX ),
+    m_sizeY( sizeY ),
+    m_geomHash( geomHash ),
+    m_cellCount( 0 )
+{
+    assert( m_sizeX > 0 && m_sizeY > 0 );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPixelCoverage::Create( const std::vector< SVert >& triangle, CThreadPool *pPool )
+{
+    m_cellCount = static_cast< int >( triangle.size() / 3 );
+    
+    // Rasterize ranges of faces in parallel on the pool, or at once without it. Spans keep
+    // the face order with any number of ranges.
+    const int rangeCount = pPool ? pPool->GetThreadCount() * g_rangePerThread : 1;
+    std::vector< TRowSpanVec > rangeSpans( rangeCount );
+    const CThreadPool::TRangeTask rasterize = [ this, &triangle, &rangeSpans, rangeCount ]( const int begin, const int end )
+    {
+        for( int i = begin; i < end; ++i )
+        {
+            const int faceBegin = static_cast< int >( static_cast< int64_t >( m_cellCount ) * i / rangeCount );
+            const int faceEnd = static_cast< int >( static_cast< int64_t >( m_cellCount ) * ( i + 1 ) / rangeCount );
+            RasterizeFaces( triangle, faceBegin, faceEnd, &rangeSpans[i] );
+        }
+    };
+    if( pPool )
+        pPool->ParallelFor( rangeCount, rasterize );
+    else
+        rasterize( 0, rangeCount );
+    
+    // Bucket spans by row
+    m_rowStart.assign( m_sizeY + 1, 0 );
+    for( int i = 0; i < rangeCount; ++i )
+        for( size_t j = 0; j < rangeSpans[i].size(); ++j )
+            ++m_rowStart[rangeSpans[i][j].row + 1];
+    for( int y = 0; y < m_sizeY; ++y )
+        m_rowStart[y + 1] += m_rowStart[y];
+    
+    m_span.resize( m_rowStart[m_sizeY] );
+    std::vector< int > rowPos( m_rowStart.begin(), m_rowStart.end() - 1 );
+    for( int i = 0; i < rangeCount; ++i )
+    {
+        for( size_t j = 0; j < rangeSpans[i].size(); ++j )
+        {
+            const SRowSpan& rowSpan = rangeSpans[i][j];
+            m_span[rowPos[rowSpan.row]++] = rowSpan.span;
+        }
+        TRowSpanVec().swap( rangeSpans[i] );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPixelCoverage::RasterizeFaces( const std::vector< SVert >& triangle, const int faceBegin, const int faceEnd,
+                                     TRowSpanVec *pSpans ) const
+{
+    assert( pSpans );
+    const int subSizeX = m_sizeX * g_subSampleCount;
+    const int subSizeY = m_sizeY * g_subSampleCount;
+    const float pixelSizeX = 360.0f / static_cast< float >( m_sizeX );
+    const float pixelSizeY = 180.0f / static_cast< float >( m_sizeY );
+    
+    // Directions of sub-sample centers
+    std::vector< float > subLonX( subSizeX );
+    std::vector< float > subLonZ( subSizeX );
+    for( int i = 0; i < subSizeX; ++i )
+    {
+        const float lon = ( static_cast< float >( i ) + 0.5f ) * 360.0f / static_cast< float >( subSizeX );
+        subLonX[i] = -cos( lon / g_radToDegCoef );
+        subLonZ[i] = sin( lon / g_radToDegCoef );
+    }
+    std::vector< float > subLatSin( subSizeY );
+    std::vector< float > subLatCos( subSizeY );
+    for( int i = 0; i < subSizeY; ++i )
+    {
+        const float lat = 90.0f - ( static_cast< float >( i ) + 0.5f ) * 180.0f / static_cast< float >( subSizeY );
+        subLatSin[i] = sin( lat / g_radToDegCoef );
+        subLatCos[i] = cos( lat / g_radToDegCoef );
+    }
+    
+    std::vector< int > rowCount( m_sizeX + 1 );
+    for( int faceID = faceBegin; faceID < faceEnd; ++faceID )
+    {
+        const SVert& a = triangle[faceID * 3];
+        const SVert& b = triangle[faceID * 3 + 1];
+        const SVert& c = triangle[faceID * 3 + 2];
+        const SSphereTriangle tria( a, b, c );
+        
+        // Bounding box. Edges are great circle arcs and bulge away from the equator, so
+        // pad latitude by the arc sagitta.
+        const float maxAngle = acos( std::min( std::min( Dot( a, b ), Dot( b, c ) ), Dot( c, a ) ) );
+        const float padLat = maxAngle * maxAngle * 0.125f * g_radToDegCoef + pixelSizeY;
+        float latMin = std::min( std::min( GetLat( a ), GetLat( b ) ), GetLat( c ) ) - padLat;
+        float latMax = std::max( std::max( GetLat( a ), GetLat( b ) ), GetLat( c ) ) + padLat;
+        
+        const float lonA = GetLon( a );
+        float lonMin = lonA;
+        float lonMax = lonA;
+        const float lonOther[2] = { GetLon( b ), GetLon( c ) };
+        for( int i = 0; i < 2; ++i )
+        {
+            float delta = lonOther[i] - lonA;
+            if( delta > 180.0f )
+                delta -= 360.0f;
+            else if( delta < -180.0f )
+                delta += 360.0f;
+            lonMin = std::min( lonMin, lonA + delta );
+            lonMax = std::max( lonMax, lonA + delta );
+        }
+        
+        bool bIsFullLon = false;
+        if( tria.IsInside( SVert( 0.0f, 1.0f, 0.0f ) ) )
+        {
+            latMax = 90.0f;
+            bIsFullLon = true;
+        }
+        if( tria.IsInside( SVert( 0.0f, -1.0f, 0.0f ) ) )
+        {
+            latMin = -90.0f;
+            bIsFullLon = true;
+        }
+        
+        const float maxAbsLat = std::min( 89.0f, std::max( std::fabs( latMin ), std::fabs( latMax ) ) );
+        const float padLon = padLat / cos( maxAbsLat / g_radToDegCoef ) + pixelSizeX;
+        lonMin -= padLon;
+        lonMax += padLon;
+        if( lonMax - lonMin >= 360.0f )
+            bIsFullLon = true;
+        
+        const int yA = std::max( 0, static_cast< int >( floor( ( 90.0f - latMax ) / pixelSizeY ) ) );
+        const int yB = std::min( m_sizeY - 1, static_cast< int >( floor( ( 90.0f - latMin ) / pixelSizeY ) ) );
+        
+        // Just under 360 degrees may still round to more than a full row, then a wrapped pixel
+        // would be counted twice
+        int xA = static_cast< int >( floor( lonMin / pixelSizeX ) );
+        int xB = static_cast< int >( floor( lonMax / pixelSizeX ) );
+        if( bIsFullLon || xB - xA + 1 >= m_sizeX )
+        {
+            xA = 0;
+            xB = m_sizeX - 1;
+        }
+        
+        // Count covered sub-samples of every pixel and merge equal neighbours into spans
+        const size_t firstSpan = pSpans->size();
+        float totalWeight = 0.0f;
+        for( int y = yA; y <= yB; ++y )
+        {
+            const float rowArea = cos( ( 90.0f - ( static_cast< float >( y ) + 0.5f ) * pixelSizeY ) / g_radToDegCoef );
+            int runStart = 0;
+            int runCount = 0;
+            int runX = 0;
+            for( int x = xA; x <= xB + 1; ++x )
+            {
+                const int pixelX = ( ( x % m_sizeX ) + m_sizeX ) % m_sizeX;
+                int count = 0;
+                if( x <= xB )
+                    for( int sy = 0; sy < g_subSampleCount; ++sy )
+                    {
+                        const int subY = y * g_subSampleCount + sy;
+                        for( int sx = 0; sx < g_subSampleCount; ++sx )
+                        {
+                            const int subX = pixelX * g_subSampleCount + sx;
+                            const SVert dir( subLatCos[subY] * subLonX[subX], subLatSin[subY], subLatCos[subY] * subLonZ[subX] );
+                            if( tria.IsInside( dir ) )
+                                ++count;
+                        }
+                    }
+                
+                // Close the run on a count change or on the image border
+                const bool bIsBreak = ( count != runCount ) || ( pixelX == 0 );
+                if( bIsBreak && runCount > 0 )
+                {
+                    SRowSpan rowSpan;
+                    rowSpan.row = y;
+                    rowSpan.span.cellID = faceID;
+                    rowSpan.span.x0 = runStart;
+                    rowSpan.span.length = runX - runStart + 1;
+                    rowSpan.span.weight = static_cast< float >( runCount * rowSpan.span.length ) * rowArea;
+                    totalWeight += rowSpan.span.weight;
+                    pSpans->push_back( rowSpan );
+                }
+                if( bIsBreak )
+                {
+                    runStart = pixelX;
+                    runCount = count;
+                }
+                runX = pixelX;
+            }
+        }
+        
+        // Face is smaller than a sub-sample: take the pixel under its center
+        if( pSpans->size() == firstSpan )
+        {
+            const SVert center = a + b + c;
+            const int x = std::min( m_sizeX - 1, static_cast< int >( GetLon( center ) / pixelSizeX ) );
+            const int y = std::min( m_sizeY - 1, static_cast< int >( ( 90.0f - GetLat( center.GetNormalazed() ) ) / pixelSizeY ) );
+            SRowSpan rowSpan;
+            rowSpan.row = y;
+            rowSpan.span.cellID = faceID;
+            rowSpan.span.x0 = x;
+            rowSpan.span.length = 1;
+            rowSpan.span.weight = 1.0f;
+            totalWeight = 1.0f;
+            pSpans->push_back( rowSpan );
+        }
+        
+        // Weight per pixel
+        for( size_t i = firstSpan; i < pSpans->size(); ++i )
+        {
+            SCoverSpan& span = (*pSpans)[i].span;
+            span.weight /= totalWeight * static_cast< float >( span.length );
+        }
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CPixelCoverage::Load( const char *pFilename, const int cellCount )
+{
+    std::ifstream file;
+    file.open( pFilename, std::ios::in | std::ios::binary );
+    if( !file.is_open() )
+        return false;
+    
+    // Check header
+    const int fileCellCount = ReadInt( file );
+    const int sizeX = ReadInt( file );
+    const int sizeY = ReadInt( file );
+    uint64_t geomHash = 0;
+    file.read( (char*)&geomHash, sizeof( uint64_t ) );
+    const int spanCount = ReadInt( file );
+    if( file.fail() || fileCellCount != cellCount || sizeX != m_sizeX || sizeY != m_sizeY ||
+        geomHash != m_geomHash || spanCount < 0 )
+        return false;
+    
+    // Truncated or padded file is rejected before anything is allocated
+    const std::streamoff headerSize = file.tellg();
+    file.seekg( 0, std::ios::end );
+    const std::streamoff fileSize = file.tellg();
+    const std::streamoff dataSize = sizeof( int ) * static_cast< std::streamoff >( m_sizeY + 1 ) +
+                                    sizeof( SCoverSpan ) * static_cast< std::streamoff >( spanCount );
+    if( fileSize != headerSize + dataSize )
+        return false;
+    file.seekg( headerSize );
+    
+    m_cellCount = cellCount;
+    m_rowStart.resize( m_sizeY + 1 );
+    m_span.resize( spanCount );
+    file.read( (char*)m_rowStart.data(), sizeof( int ) * m_rowStart.size() );
+    file.read( (char*)m_span.data(), sizeof( SCoverSpan ) * m_span.size() );
+    if( file.fail() )
+        return false;
+    
+    // Spans are used as indices of cells and pixels, so every one of them is checked
+    bool bIsValid = ( 0 == m_rowStart[0] && spanCount == m_rowStart[m_sizeY] );
+    for( int y = 0; y < m_sizeY && bIsValid; ++y )
+        bIsValid = ( m_rowStart[y] <= m_rowStart[y + 1] );
+    for( int i = 0; i < spanCount && bIsValid; ++i )
+    {
+        const SCoverSpan& span = m_span[i];
+        bIsValid = ( span.cellID >= 0 && span.cellID < cellCount &&
+                     span.x0 >= 0 && span.length > 0 && span.length <= m_sizeX - span.x0 &&
+                     span.weight >= 0.0f );
+    }
+    
+    return bIsValid;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPixelCoverage::Save( const char *pFilename ) const
+{
+    printf( "\nSaving pixel coverage to %s...\n", pFilename );
+    
+    const int spanCount = static_cast< int >( m_span.size() );
+    printf( "\tSpan: %d\n", spanCount );
+    
+    std::ofstream file;
+    file.open( pFilename, std::ios::out | std::ios::binary );
+    
+    // Write header
+    file.write( (char*)&m_cellCount, sizeof( int ) );
+    file.write( (char*)&m_sizeX, sizeof( int ) );
+    file.write( (char*)&m_sizeY, sizeof( int ) );
+    file.write( (char*)&m_geomHash, sizeof( uint64_t ) );
+    file.write( (char*)&spanCount, sizeof( int ) );
+    
+    // Write rows and spans
+    file.write( (char*)m_rowStart.data(), sizeof( int ) * m_rowStart.size() );
+    file.write( (char*)m_span.data(), sizeof( SCoverSpan ) * m_span.size() );
+    
+    file.close();
+    
+    printf( "\tSaving pixel coverage completed.\n");
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CPixelCoverage::GetSizeX() const
+{
+    return m_sizeX;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CPixelCoverage::GetSizeY() const
+{
+    return m_sizeY;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CPixelCoverage::GetCellCount() const
+{
+    return m_cellCount;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CPixelCoverage::GetRowSpanStart( const int y ) const
+{
+    assert( y >= 0 && y <= m_sizeY );
+    return m_rowStart[y];
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const SCoverSpan *CPixelCoverage::GetSpans() const
+{
+    return m_span.data();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
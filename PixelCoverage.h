@@ -0,0 +1,68 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  PixelCoverage.h
+//  GeoData
+//
+//  Class CPixelCoverage: exact coverage of equirectangular image pixels by geoid faces
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstdint>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+struct SVert;
+class CThreadPool;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Run of pixels [x0, x0 + length) of one row covered by one face. Weight is the covered part of
+// the pixel area over the face area, so the weights of every face sum up to 1.
+struct SCoverSpan
+{
+    int         cellID;
+    int         x0;
+    int         length;
+    float       weight;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+class CPixelCoverage
+{
+public:
+    // Geometry hash ties the coverage to the faces of one geometry file, a cached coverage
+    // of another file is rejected by Load
+    CPixelCoverage( const int sizeX, const int sizeY, const uint64_t geomHash );
+
+    void        Create( const std::vector< SVert >& triangle, CThreadPool *pPool );
+    bool        Load( const char *pFilename, const int cellCount );
+    void        Save( const char *pFilename ) const;
+
+    int         GetSizeX() const;
+    int         GetSizeY() const;
+    int         GetCellCount() const;
+    int         GetRowSpanStart( const int y ) const;
+    const SCoverSpan *GetSpans() const;
+
+private:
+
+    // Span with its row used while rasterizing
+    struct SRowSpan
+    {
+        int         row;
+        SCoverSpan  span;
+    };
+    typedef std::vector< SRowSpan > TRowSpanVec;
+
+    // Declate bu never define to preven copy
+    CPixelCoverage( const CPixelCoverage& );
+    CPixelCoverage& operator=( const CPixelCoverage& );
+
+    void        RasterizeFaces( const std::vector< SVert >& triangle, const int faceBegin, const int faceEnd,
+                                TRowSpanVec *pSpans ) const;
+
+    std::vector< int >          m_rowStart;
+    std::vector< SCoverSpan >   m_span;
+    const int                   m_sizeX;
+    const int                   m_sizeY;
+    const uint64_t              m_geomHash;
+    int                         m_cellCount;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
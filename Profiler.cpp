@@ -0,0 +1,312 @@
+#include "Profiler.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+struct SProfileRegion
+{
+    const char  *pName;
+    std::string arg;
+    uint64_t    startNS;        // Wall clock since the profiler was enabled
+    uint64_t    wallTimeNS;
+    uint64_t    cpuTimeNS;
+    uint64_t    counter[CPerfCounters::COUNTER_COUNT];
+    bool        bHasCounters;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+struct SProfileThread
+{
+    int                             id;     // tid of the trace
+    std::string                     name;
+    std::vector< SProfileRegion >   region;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Threads are registered once, then every thread appends to its own regions
+static std::atomic< bool >  g_bIsProfilerEnabled( false );
+static uint64_t             g_profilerStartNS = 0;
+static std::mutex           g_profilerMutex;
+static std::vector< std::unique_ptr< SProfileThread > > g_profileThread;
+static thread_local SProfileThread *g_pProfileThread = nullptr;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t GetWallTimeNS()
+{
+    const std::chrono::steady_clock::duration time = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast< std::chrono::nanoseconds >( time ).count();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// CPU time of the calling thread only. GetProcessTime sums all threads of the process.
+static uint64_t GetThreadCpuTimeNS()
+{
+    timespec time;
+    if( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &time ) != 0 )
+        return 0;
+    return static_cast< uint64_t >( time.tv_sec ) * 1000000000ULL + time.tv_nsec;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static SProfileThread *GetProfileThread()
+{
+    if( g_pProfileThread )
+        return g_pProfileThread;
+    
+    std::lock_guard< std::mutex > lock( g_profilerMutex );
+    g_profileThread.push_back( std::unique_ptr< SProfileThread >( new SProfileThread ) );
+    g_pProfileThread = g_profileThread.back().get();
+    g_pProfileThread->id = static_cast< int >( g_profileThread.size() );
+    g_pProfileThread->name = "thread " + std::to_string( g_pProfileThread->id );
+    return g_pProfileThread;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void WriteJsonString( std::ofstream& file, const char *pStr )
+{
+    file << '"';
+    for( ; *pStr; ++pStr )
+    {
+        if( '"' == *pStr || '\\' == *pStr )
+            file << '\\' << *pStr;
+        else if( static_cast< unsigned char >( *pStr ) >= 0x20 )
+            file << *pStr;
+    }
+    file << '"';
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CProfiler::Enable()
+{
+    g_profilerStartNS = GetWallTimeNS();
+    g_bIsProfilerEnabled = true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CProfiler::IsEnabled()
+{
+    return g_bIsProfilerEnabled.load( std::memory_order_relaxed );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CProfiler::SetThreadName( const char *pName, const int id )
+{
+    assert( pName );
+    if( !IsEnabled() )
+        return;
+    
+    SProfileThread *pThread = GetProfileThread();
+    pThread->name = pName;
+    if( id >= 0 )
+        pThread->name += " " + std::to_string( id );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CProfiler::SaveTrace( const char *pFilename )
+{
+    assert( pFilename );
+    std::ofstream file( pFilename, std::ios::out );
+    if( !file.is_open() )
+    {
+        std::cout << "Can't write trace: " << pFilename << std::endl;
+        return false;
+    }
+    
+    // Complete events in microseconds, tdur is CPU time of the thread
+    std::lock_guard< std::mutex > lock( g_profilerMutex );
+    file << std::fixed << std::setprecision( 3 );
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool bIsFirst = true;
+    for( size_t i = 0; i < g_profileThread.size(); ++i )
+    {
+        const SProfileThread& thread = *g_profileThread[i];
+        file << ( bIsFirst ? "\n" : ",\n" );
+        file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread.id << ",\"args\":{\"name\":";
+        WriteJsonString( file, thread.name.c_str() );
+        file << "}}";
+        bIsFirst = false;
+        
+        for( size_t j = 0; j < thread.region.size(); ++j )
+        {
+            const SProfileRegion& region = thread.region[j];
+            file << ",\n{\"name\":";
+            WriteJsonString( file, region.pName );
+            file << ",\"cat\":\"GeoData\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread.id;
+            file << ",\"ts\":" << region.startNS * 0.001;
+            file << ",\"dur\":" << region.wallTimeNS * 0.001;
+            file << ",\"tdur\":" << region.cpuTimeNS * 0.001;
+            
+            // Details and counters are shown in the selection of the region
+            file << ",\"args\":{";
+            const char *pSeparator = "";
+            if( !region.arg.empty() )
+            {
+                file << "\"detail\":";
+                WriteJsonString( file, region.arg.c_str() );
+                pSeparator = ",";
+            }
+            for( int k = 0; k < CPerfCounters::COUNTER_COUNT && region.bHasCounters; ++k )
+            {
+                const CPerfCounters::ECounter counter = static_cast< CPerfCounters::ECounter >( k );
+                if( !CPerfCounters::IsAvailable( counter ) )
+                    continue;
+                file << pSeparator << "\"" << CPerfCounters::GetName( counter ) << "\":" << region.counter[k];
+                pSeparator = ",";
+            }
+            file << "}}";
+        }
+    }
+    file << "\n]}\n";
+    file.close();
+    
+    std::cout << "Trace saved to: " << pFilename << std::endl;
+    return !file.fail();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CProfiler::Report()
+{
+    struct STotal
+    {
+        const char  *pName;
+        int         count;
+        uint64_t    wallTimeNS;
+        uint64_t    cpuTimeNS;
+        uint64_t    counter[CPerfCounters::COUNTER_COUNT];
+        bool        bHasCounters;
+    };
+    
+    // Totals of regions by name over all threads in the order of the first appearance
+    std::lock_guard< std::mutex > lock( g_profilerMutex );
+    std::vector< STotal > total;
+    for( size_t i = 0; i < g_profileThread.size(); ++i )
+        for( size_t j = 0; j < g_profileThread[i]->region.size(); ++j )
+        {
+            const SProfileRegion& region = g_profileThread[i]->region[j];
+            size_t k = 0;
+            while( k < total.size() && strcmp( total[k].pName, region.pName ) != 0 )
+                ++k;
+            if( k == total.size() )
+            {
+                total.push_back( STotal() );
+                memset( &total.back(), 0, sizeof( STotal ) );
+                total.back().pName = region.pName;
+            }
+            ++total[k].count;
+            total[k].wallTimeNS += region.wallTimeNS;
+            total[k].cpuTimeNS += region.cpuTimeNS;
+            if( region.bHasCounters )
+            {
+                total[k].bHasCounters = true;
+                for( int c = 0; c < CPerfCounters::COUNTER_COUNT; ++c )
+                    total[k].counter[c] += region.counter[c];
+            }
+        }
+    
+    // Regions of several threads overlap, their wall time is summed
+    printf( "\nProfile:\n" );
+    printf( "\t%-24s %7s %12s %12s\n", "region", "count", "wall ms", "cpu ms" );
+    for( size_t i = 0; i < total.size(); ++i )
+        printf( "\t%-24s %7d %12.3f %12.3f\n",
+            total[i].pName,
+            total[i].count,
+            total[i].wallTimeNS * 0.000001,
+            total[i].cpuTimeNS * 0.000001 );
+    
+    if( !CPerfCounters::IsEnabled() || !CPerfCounters::IsAvailable( CPerfCounters::COUNTER_CYCLES ) )
+        return;
+    
+    // Misses are per thousand instructions, - is a counter the CPU doesn't have
+    const bool bHasInstructions = CPerfCounters::IsAvailable( CPerfCounters::COUNTER_INSTRUCTIONS );
+    printf( "\nHardware counters:\n" );
+    const CPerfCounters::ECounter missCounter[3] =
+    {
+        CPerfCounters::COUNTER_CACHE_MISSES,
+        CPerfCounters::COUNTER_BRANCH_MISSES,
+        CPerfCounters::COUNTER_NODE_MISSES
+    };
+    printf( "\t%-24s %12s %12s %6s %12s %12s %12s\n", "region", "Mcycles", "Minstr", "IPC", "cache MPKI", "branch MPKI", "node MPKI" );
+    for( size_t i = 0; i < total.size(); ++i )
+    {
+        if( !total[i].bHasCounters )
+            continue;
+        
+        const uint64_t *pCounter = total[i].counter;
+        const double instructions = static_cast< double >( pCounter[CPerfCounters::COUNTER_INSTRUCTIONS] );
+        char column[4][16] = { "-", "-", "-", "-" };
+        if( bHasInstructions && pCounter[CPerfCounters::COUNTER_CYCLES] > 0 )
+            snprintf( column[0], sizeof( column[0] ), "%.2f", instructions / pCounter[CPerfCounters::COUNTER_CYCLES] );
+        for( int c = 0; c < 3; ++c )
+        {
+            const CPerfCounters::ECounter counter = missCounter[c];
+            if( bHasInstructions && CPerfCounters::IsAvailable( counter ) && instructions > 0.0 )
+                snprintf( column[c + 1], sizeof( column[c + 1] ), "%.3f", 1000.0 * pCounter[counter] / instructions );
+        }
+        
+        printf( "\t%-24s %12.3f %12.3f %6s %12s %12s %12s\n",
+            total[i].pName,
+            pCounter[CPerfCounters::COUNTER_CYCLES] * 0.000001,
+            instructions * 0.000001,
+            column[0],
+            column[1],
+            column[2],
+            column[3] );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CProfileScope::CProfileScope( const char *pName )
+{
+    Start( pName, nullptr );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CProfileScope::CProfileScope( const char *pName, const char *pArg )
+{
+    Start( pName, pArg );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CProfileScope::CProfileScope( const char *pName, const int arg )
+{
+    snprintf( m_argBuffer, sizeof( m_argBuffer ), "%d", arg );
+    Start( pName, m_argBuffer );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CProfileScope::~CProfileScope()
+{
+    if( !m_bIsActive )
+        return;
+    
+    // In the reverse order of the start, so counters see the least of the timing
+    uint64_t counter[CPerfCounters::COUNTER_COUNT];
+    const bool bHasCounters = m_bHasCounters && CPerfCounters::Read( counter );
+    const uint64_t cpuTimeNS = GetThreadCpuTimeNS();
+    const uint64_t wallTimeNS = GetWallTimeNS();
+    SProfileThread *pThread = GetProfileThread();
+    pThread->region.push_back( SProfileRegion() );
+    SProfileRegion& region = pThread->region.back();
+    region.pName = m_pName;
+    region.arg = m_pArg ? m_pArg : "";
+    region.startNS = m_wallTimeNS - g_profilerStartNS;
+    region.wallTimeNS = wallTimeNS - m_wallTimeNS;
+    region.cpuTimeNS = cpuTimeNS - m_cpuTimeNS;
+    region.bHasCounters = bHasCounters;
+    for( int i = 0; i < CPerfCounters::COUNTER_COUNT; ++i )
+        region.counter[i] = bHasCounters ? counter[i] - m_counter[i] : 0;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CProfileScope::Start( const char *pName, const char *pArg )
+{
+    assert( pName );
+    m_pName = pName;
+    m_pArg = pArg;
+    m_bIsActive = CProfiler::IsEnabled();
+    m_bHasCounters = false;
+    if( !m_bIsActive )
+        return;
+    
+    m_wallTimeNS = GetWallTimeNS();
+    m_cpuTimeNS = GetThreadCpuTimeNS();
+    if( CPerfCounters::IsEnabled() )
+        m_bHasCounters = CPerfCounters::Read( m_counter );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  Profiler.h
+//  GeoData
+//
+//  Class CProfiler: scoped wall clock and thread CPU timers with Chrome trace export
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstdint>
+
+#include "PerfCounters.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Timers do nothing until the profiler is enabled. Every thread records its own regions, so
+// timing takes no locks. Traces are saved after the threads are joined and open in
+// chrome://tracing or ui.perfetto.dev.
+class CProfiler
+{
+public:
+    static void     Enable();
+    static bool     IsEnabled();
+    
+    // Name of the calling thread in the trace, e.g. "decode 2". No number if id < 0.
+    static void     SetThreadName( const char *pName, const int id );
+    
+    static bool     SaveTrace( const char *pFilename );
+    static void     Report();
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Region from the constructor to the destructor. The name has to be a string constant,
+// the argument (file name, level) has to outlive the scope. Hardware counters are read
+// around the region if they are enabled.
+class CProfileScope
+{
+public:
+    explicit CProfileScope( const char *pName );
+    CProfileScope( const char *pName, const char *pArg );
+    CProfileScope( const char *pName, const int arg );
+    ~CProfileScope();
+
+private:
+    
+    // Declate bu never define to preven copy
+    CProfileScope( const CProfileScope& );
+    CProfileScope& operator=( const CProfileScope& );
+    
+    void            Start( const char *pName, const char *pArg );
+    
+    const char      *m_pName;
+    const char      *m_pArg;
+    char            m_argBuffer[16];
+    uint64_t        m_wallTimeNS;
+    uint64_t        m_cpuTimeNS;
+    uint64_t        m_counter[CPerfCounters::COUNTER_COUNT];
+    bool            m_bIsActive;
+    bool            m_bHasCounters;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,395 @@
+#include "RasterCache.h"
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "Utils.h"
+#include "jpeg/jpgd.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const uint32_t   g_rasterMagic = 0x31435247;     // "GRC1"
+static const size_t     g_rasterHeaderSize = 16384;     // Page size multiple on every platform we run on
+static const char      *g_pRasterExt = ".raw";
+////////////////////////////////////////////////////////////////////////////////////////////////////
+struct SRasterHeader
+{
+    uint32_t    magic;
+    int32_t     sizeX;
+    int32_t     sizeY;
+    int32_t     channelCount;
+    int32_t     scaleShift;
+    uint64_t    sourceHash;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CRasterCache::CRasterCache( const char *pDirectory, const uint64_t sizeLimit ) :
+    m_directory( pDirectory ),
+    m_sizeLimit( sizeLimit ),
+    m_tempCounter( 0 )
+{
+    assert( pDirectory );
+    if( mkdir( pDirectory, 0755 ) != 0 && errno != EEXIST )
+        std::cout << "Can't create raster cache directory: " << m_directory << std::endl;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string CRasterCache::GetFilename( const uint64_t sourceHash, const int scaleShift ) const
+{
+    char name[64];
+    snprintf( name, sizeof( name ), "/%016llx_%d", static_cast< unsigned long long >( sourceHash ), scaleShift );
+    return m_directory + name + g_pRasterExt;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string CRasterCache::GetTempFilename( const std::string& filename )
+{
+    // Unique per reader, so two threads decoding the same source don't write one file
+    std::lock_guard< std::mutex > lock( m_mutex );
+    const uint64_t tempID = m_tempCounter++;
+    return filename + ".tmp" + std::to_string( tempID );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CRasterCache::Touch( const std::string& filename )
+{
+    // Modification time is the last use time for eviction
+    utimes( filename.c_str(), nullptr );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CRasterCache::Commit( const std::string& tempFilename, const std::string& filename )
+{
+    std::lock_guard< std::mutex > lock( m_mutex );
+    if( rename( tempFilename.c_str(), filename.c_str() ) != 0 )
+    {
+        std::cout << "Can't store raster in cache: " << filename << std::endl;
+        remove( tempFilename.c_str() );
+        return;
+    }
+    
+    Evict( filename );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CRasterCache::Evict( const std::string& keepFilename )
+{
+    struct SEntry
+    {
+        std::string filename;
+        uint64_t    size;
+        time_t      lastUse;
+    };
+    
+    DIR *pDir = opendir( m_directory.c_str() );
+    if( !pDir )
+        return;
+    
+    std::vector< SEntry > entry;
+    uint64_t totalSize = 0;
+    const size_t extLength = strlen( g_pRasterExt );
+    while( const dirent *pItem = readdir( pDir ) )
+    {
+        const size_t nameLength = strlen( pItem->d_name );
+        if( nameLength <= extLength || strcmp( pItem->d_name + nameLength - extLength, g_pRasterExt ) != 0 )
+            continue;
+        
+        SEntry item;
+        item.filename = m_directory + "/" + pItem->d_name;
+        struct stat info;
+        if( stat( item.filename.c_str(), &info ) != 0 || !S_ISREG( info.st_mode ) )
+            continue;
+        
+        item.size = static_cast< uint64_t >( info.st_size );
+        item.lastUse = info.st_mtime;
+        totalSize += item.size;
+        entry.push_back( item );
+    }
+    closedir( pDir );
+    
+    if( totalSize <= m_sizeLimit )
+        return;
+    
+    // Least recently used first. Mapped files stay readable after removal.
+    std::sort( entry.begin(), entry.end(), []( const SEntry& a, const SEntry& b ) { return a.lastUse < b.lastUse; } );
+    for( size_t i = 0; i < entry.size() && totalSize > m_sizeLimit; ++i )
+    {
+        if( entry[i].filename == keepFilename )
+            continue;
+        
+        if( remove( entry[i].filename.c_str() ) == 0 )
+        {
+            totalSize -= entry[i].size;
+            printf( "Raster cache: evicted %s\n", entry[i].filename.c_str() );
+        }
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CRasterReader::CRasterReader( CRasterCache *pCache ) :
+    m_pCache( pCache ),
+    m_sourceHash( 0 ),
+    m_sourceSizeX( 0 ),
+    m_sourceSizeY( 0 ),
+    m_pMapped( nullptr ),
+    m_mappedSize( 0 ),
+    m_sizeX( 0 ),
+    m_sizeY( 0 ),
+    m_channelCount( 0 ),
+    m_pixelStride( 0 ),
+    m_lineID( 0 )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CRasterReader::~CRasterReader()
+{
+    UnmapFile();
+    
+    // Unfinished raster is never committed
+    if( m_file.is_open() )
+    {
+        m_file.close();
+        remove( m_tempFilename.c_str() );
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CRasterReader::Open( const char *pFilename, const uint64_t sourceHash )
+{
+    // Использован код из:
+    // http://code.google.com/p/jpeg-compressor/
+    jpgd::jpeg_decoder_file_stream *pStream = new jpgd::jpeg_decoder_file_stream();
+    m_pStream.reset( pStream );
+    if( !pStream->open( pFilename ) || !OpenDecoder() )
+        return false;
+    
+    m_sourceHash = sourceHash;
+    if( m_pCache && 0 == m_sourceHash )
+        m_sourceHash = CalcFileHash( pFilename );
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CRasterReader::Open( const uint8_t *pData, const size_t size, const uint64_t sourceHash )
+{
+    assert( pData );
+    if( size > UINT32_MAX )
+        return false;
+    
+    m_pStream.reset( new jpgd::jpeg_decoder_mem_stream( pData, static_cast< jpgd::uint >( size ) ) );
+    if( !OpenDecoder() )
+        return false;
+    
+    m_sourceHash = sourceHash;
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CRasterReader::OpenDecoder()
+{
+    m_pDecoder.reset( new jpgd::jpeg_decoder( m_pStream.get() ) );
+    if( m_pDecoder->get_error_code() != jpgd::JPGD_SUCCESS )
+        return false;
+    
+    m_sourceSizeX = m_pDecoder->get_width();
+    m_sourceSizeY = m_pDecoder->get_height();
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CRasterReader::Begin( const int scaleShift )
+{
+    assert( m_pDecoder );
+    m_lineID = 0;
+    
+    if( m_pCache && m_sourceHash )
+    {
+        const std::string filename = m_pCache->GetFilename( m_sourceHash, scaleShift );
+        if( MapFile( filename, scaleShift ) )
+        {
+            m_pCache->Touch( filename );
+            return true;
+        }
+    }
+    
+    if( !m_pDecoder->set_scale_shift( scaleShift ) || m_pDecoder->begin_decoding() != jpgd::JPGD_SUCCESS )
+        return false;
+    
+    m_sizeX = m_pDecoder->get_width();
+    m_sizeY = m_pDecoder->get_height();
+    m_pixelStride = m_pDecoder->get_bytes_per_pixel();
+    m_channelCount = ( m_pixelStride == 1 ) ? 1 : 3;
+    
+    if( m_pCache && m_sourceHash )
+    {
+        m_filename = m_pCache->GetFilename( m_sourceHash, scaleShift );
+        m_tempFilename = m_pCache->GetTempFilename( m_filename );
+        m_file.open( m_tempFilename.c_str(), std::ios::out | std::ios::binary );
+        if( m_file.is_open() )
+        {
+            std::vector< char > header( g_rasterHeaderSize, 0 );
+            SRasterHeader& info = *reinterpret_cast< SRasterHeader* >( header.data() );
+            info.magic = g_rasterMagic;
+            info.sizeX = m_sizeX;
+            info.sizeY = m_sizeY;
+            info.channelCount = m_channelCount;
+            info.scaleShift = scaleShift;
+            info.sourceHash = m_sourceHash;
+            m_file.write( header.data(), header.size() );
+            m_row.resize( m_sizeX * m_channelCount );
+        }
+    }
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CRasterReader::ReadLine( const uint8_t **ppLine )
+{
+    assert( ppLine );
+    if( m_lineID >= m_sizeY )
+        return false;
+    
+    if( m_pMapped )
+    {
+        *ppLine = m_pMapped + g_rasterHeaderSize + static_cast< size_t >( m_lineID ) * m_sizeX * m_channelCount;
+        ++m_lineID;
+        return true;
+    }
+    
+    const uint8_t *pLine = nullptr;
+    jpgd::uint lineLength = 0;
+    if( m_pDecoder->decode( (const void**)&pLine, &lineLength ) != jpgd::JPGD_SUCCESS )
+        return false;
+    *ppLine = pLine;
+    ++m_lineID;
+    
+    if( !m_file.is_open() )
+        return true;
+    
+    // Store RGB of RGBA lines
+    if( m_pixelStride == m_channelCount )
+        m_file.write( (const char*)pLine, m_sizeX * m_channelCount );
+    else
+    {
+        uint8_t *pRow = m_row.data();
+        for( int x = 0; x < m_sizeX; ++x )
+        {
+            pRow[x * 3 + 0] = pLine[x * m_pixelStride + 0];
+            pRow[x * 3 + 1] = pLine[x * m_pixelStride + 1];
+            pRow[x * 3 + 2] = pLine[x * m_pixelStride + 2];
+        }
+        m_file.write( (const char*)pRow, m_row.size() );
+    }
+    
+    if( m_lineID == m_sizeY )
+    {
+        m_file.close();
+        if( m_file.fail() )
+            remove( m_tempFilename.c_str() );
+        else
+            m_pCache->Commit( m_tempFilename, m_filename );
+    }
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CRasterReader::GetSourceSizeX() const
+{
+    return m_sourceSizeX;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CRasterReader::GetSourceSizeY() const
+{
+    return m_sourceSizeY;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CRasterReader::GetSizeX() const
+{
+    return m_sizeX;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CRasterReader::GetSizeY() const
+{
+    return m_sizeY;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CRasterReader::GetPixelStride() const
+{
+    return m_pixelStride;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t CRasterReader::EstimateDecodeSize( const int scaleShift ) const
+{
+    assert( m_pDecoder );
+    
+    // Progressive images keep coefficients of all blocks, sequential ones of a row of MCUs.
+    // MCUs are up to 16 pixels, sizes are padded to them.
+    const size_t componentCount = m_pDecoder->get_num_components();
+    const size_t sourceSizeX = m_sourceSizeX + 15;
+    const size_t coeffRowCount = m_pDecoder->is_progressive() ? m_sourceSizeY + 15 : 16;
+    const size_t coeffSize = coeffRowCount * sourceSizeX * componentCount * sizeof( jpgd::jpgd_block_t );
+    
+    // Samples and RGBA lines of a row of MCUs at the scale, and the row written to the cache
+    const size_t sizeX = ( ( m_sourceSizeX + ( 1 << scaleShift ) - 1 ) >> scaleShift ) + 15;
+    const size_t lineSize = 16 * sizeX * ( componentCount + 4 ) + sizeX * 3;
+    
+    return sizeof( jpgd::jpeg_decoder ) + coeffSize + lineSize;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CRasterReader::IsCached() const
+{
+    return m_pMapped != nullptr;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CRasterReader::MapFile( const std::string& filename, const int scaleShift )
+{
+    const int fd = open( filename.c_str(), O_RDONLY );
+    if( fd < 0 )
+        return false;
+    
+    struct stat info;
+    if( fstat( fd, &info ) != 0 || static_cast< size_t >( info.st_size ) < g_rasterHeaderSize )
+    {
+        close( fd );
+        return false;
+    }
+    
+    const size_t fileSize = static_cast< size_t >( info.st_size );
+    void *pData = mmap( nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( MAP_FAILED == pData )
+        return false;
+    
+    m_pMapped = static_cast< const uint8_t* >( pData );
+    m_mappedSize = fileSize;
+    
+    // Reject files of other versions, hash collisions on the name or truncated writes
+    const SRasterHeader& header = *reinterpret_cast< const SRasterHeader* >( m_pMapped );
+    const bool bIsValid = header.magic == g_rasterMagic &&
+                          header.sourceHash == m_sourceHash &&
+                          header.scaleShift == scaleShift &&
+                          ( header.channelCount == 1 || header.channelCount == 3 ) &&
+                          header.sizeX > 0 && header.sizeY > 0 &&
+                          fileSize == g_rasterHeaderSize + static_cast< size_t >( header.sizeX ) * header.sizeY * header.channelCount;
+    if( !bIsValid )
+    {
+        UnmapFile();
+        return false;
+    }
+    
+    madvise( const_cast< uint8_t* >( m_pMapped ), m_mappedSize, MADV_SEQUENTIAL );
+    m_sizeX = header.sizeX;
+    m_sizeY = header.sizeY;
+    m_channelCount = header.channelCount;
+    m_pixelStride = header.channelCount;
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CRasterReader::UnmapFile()
+{
+    if( m_pMapped )
+        munmap( const_cast< uint8_t* >( m_pMapped ), m_mappedSize );
+    m_pMapped = nullptr;
+    m_mappedSize = 0;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,107 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  RasterCache.h
+//  GeoData
+//
+//  Class CRasterCache: directory of decoded rasters keyed by source file content
+//  Class CRasterReader: scanlines of an image from the cache or from the JPEG decoder
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <mutex>
+#include <memory>
+#include <fstream>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+namespace jpgd { class jpeg_decoder; class jpeg_decoder_stream; }
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Cached raster is a page-aligned header followed by raw rows of 1 (gray) or 3 (RGB) bytes
+// per pixel, so a hit is mapped to memory and read without copying. Files are named by
+// the hash of the source file and the decode scale. Least recently used files are removed
+// when the directory grows above the size limit.
+class CRasterCache
+{
+public:
+    CRasterCache( const char *pDirectory, const uint64_t sizeLimit );
+
+    std::string GetFilename( const uint64_t sourceHash, const int scaleShift ) const;
+    std::string GetTempFilename( const std::string& filename );
+    void        Touch( const std::string& filename );
+    void        Commit( const std::string& tempFilename, const std::string& filename );
+
+private:
+
+    // Declate bu never define to preven copy
+    CRasterCache( const CRasterCache& );
+    CRasterCache& operator=( const CRasterCache& );
+
+    void        Evict( const std::string& keepFilename );
+
+    std::mutex          m_mutex;
+    const std::string   m_directory;
+    const uint64_t      m_sizeLimit;
+    uint64_t            m_tempCounter;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+class CRasterReader
+{
+public:
+    CRasterReader( CRasterCache *pCache );
+    ~CRasterReader();
+
+    // Open reads the JPEG header only, Begin chooses between the cache and the decoder.
+    // Source hash is calculated if it's 0 and there is a cache. File read into memory has
+    // to outlive the reader.
+    bool        Open( const char *pFilename, const uint64_t sourceHash );
+    bool        Open( const uint8_t *pData, const size_t size, const uint64_t sourceHash );
+    bool        Begin( const int scaleShift );
+    bool        ReadLine( const uint8_t **ppLine );
+
+    int         GetSourceSizeX() const;
+    int         GetSourceSizeY() const;
+    int         GetSizeX() const;
+    int         GetSizeY() const;
+    int         GetPixelStride() const;
+
+    // Heap the decoder needs at the scale, known after Open
+    size_t      EstimateDecodeSize( const int scaleShift ) const;
+    bool        IsCached() const;
+
+private:
+
+    // Declate bu never define to preven copy
+    CRasterReader( const CRasterReader& );
+    CRasterReader& operator=( const CRasterReader& );
+
+    bool        OpenDecoder();
+    bool        MapFile( const std::string& filename, const int scaleShift );
+    void        UnmapFile();
+
+    CRasterCache                                        *m_pCache;
+    std::unique_ptr< jpgd::jpeg_decoder_stream >        m_pStream;
+    std::unique_ptr< jpgd::jpeg_decoder >               m_pDecoder;
+    uint64_t                                            m_sourceHash;
+    int                                                 m_sourceSizeX;
+    int                                                 m_sourceSizeY;
+
+    // Cache hit
+    const uint8_t   *m_pMapped;
+    size_t          m_mappedSize;
+
+    // Cache miss: decoded rows are written to a temporary file
+    std::ofstream           m_file;
+    std::string             m_filename;
+    std::string             m_tempFilename;
+    std::vector< uint8_t >  m_row;
+
+    int             m_sizeX;
+    int             m_sizeY;
+    int             m_channelCount;
+    int             m_pixelStride;
+    int             m_lineID;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
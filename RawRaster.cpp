@@ -0,0 +1,82 @@
+#include "RawRaster.h"
+
+#include <cassert>
+#include <iostream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CRawRaster::CRawRaster() :
+    m_pMapped( nullptr ),
+    m_mappedSize( 0 ),
+    m_pSample( nullptr ),
+    m_rowSize( 0 ),
+    m_sizeX( 0 ),
+    m_sizeY( 0 )
+{}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CRawRaster::~CRawRaster()
+{
+    if( m_pMapped )
+        munmap( const_cast< uint8_t* >( m_pMapped ), m_mappedSize );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CRawRaster::Open( const char *pFilename, const int sizeX, const int sizeY, const int sampleSize,
+                       const size_t headerSize )
+{
+    assert( pFilename );
+    assert( !m_pMapped );
+    if( sizeX <= 0 || sizeY <= 0 || sampleSize <= 0 )
+        return false;
+    
+    const int fd = open( pFilename, O_RDONLY );
+    if( fd < 0 )
+        return false;
+    
+    struct stat info;
+    const size_t rowSize = static_cast< size_t >( sizeX ) * sampleSize;
+    const size_t dataSize = headerSize + rowSize * sizeY;
+    if( fstat( fd, &info ) != 0 || static_cast< size_t >( info.st_size ) < dataSize )
+    {
+        std::cout << "Raw raster is smaller than " << sizeX << "x" << sizeY << ": " << pFilename << std::endl;
+        close( fd );
+        return false;
+    }
+    
+    void *pData = mmap( nullptr, dataSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( MAP_FAILED == pData )
+        return false;
+    
+    // Rows are read once from top to bottom
+    madvise( pData, dataSize, MADV_SEQUENTIAL );
+    m_pMapped = static_cast< const uint8_t* >( pData );
+    m_mappedSize = dataSize;
+    m_pSample = m_pMapped + headerSize;
+    m_rowSize = rowSize;
+    m_sizeX = sizeX;
+    m_sizeY = sizeY;
+    
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CRawRaster::GetSizeX() const
+{
+    return m_sizeX;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CRawRaster::GetSizeY() const
+{
+    return m_sizeY;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const uint8_t *CRawRaster::GetRow( const int y ) const
+{
+    assert( m_pSample );
+    assert( y >= 0 && y < m_sizeY );
+    return m_pSample + m_rowSize * y;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
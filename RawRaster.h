@@ -0,0 +1,42 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  RawRaster.h
+//  GeoData
+//
+//  Class CRawRaster: memory mapped raw raster of int16 or float32 samples
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Row-major samples after an optional header of headerSize bytes. Rows point straight into
+// the mapped file.
+class CRawRaster
+{
+public:
+    CRawRaster();
+    ~CRawRaster();
+
+    bool            Open( const char *pFilename, const int sizeX, const int sizeY, const int sampleSize,
+                          const size_t headerSize );
+
+    int             GetSizeX() const;
+    int             GetSizeY() const;
+    const uint8_t  *GetRow( const int y ) const;
+
+private:
+
+    // Declate bu never define to preven copy
+    CRawRaster( const CRawRaster& );
+    CRawRaster& operator=( const CRawRaster& );
+
+    const uint8_t   *m_pMapped;
+    size_t          m_mappedSize;
+    const uint8_t   *m_pSample;
+    size_t          m_rowSize;
+    int             m_sizeX;
+    int             m_sizeY;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1,7 +1,20 @@
 #include "TerraData.h"
 
 #include <fstream>
+#include <iostream>
 #include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <bitset>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Profiler.h"
+#include "ThreadPool.h"
+#include "Utils.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 STerraData::STerraData() :
@@ -19,22 +32,72 @@ STerraData::STerraData() :
     }
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-CTerraData::CTerraData( const int count ) :
-    m_count( count )
+float& STerraData::GetField( const int field )
+{
+    assert( field >= 0 && field < TERRA_FIELD_COUNT );
+    if( TERRA_FIELD_HEIGHT == field )
+        return height;
+    else if( TERRA_FIELD_POPULATION == field )
+        return population;
+    else if( field < TERRA_FIELD_TEMP_NIGHT )
+        return landTempDay[field - TERRA_FIELD_TEMP_DAY];
+    else if( field < TERRA_FIELD_TEMP_SEA )
+        return landTempNight[field - TERRA_FIELD_TEMP_NIGHT];
+    else
+        return seaTemp[field - TERRA_FIELD_TEMP_SEA];
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CTerraData::CTerraData( const int count, CThreadPool *pPool ) :
+    m_validMask( static_cast< size_t >( TERRA_FIELD_COUNT ) * ( ( count + 63 ) / 64 ), 0 ),
+    m_count( count ),
+    m_wordCount( ( count + 63 ) / 64 )
 {
-    assert( m_count > 0 );
+    assert( m_count > 0 && pPool );
+    
+    // Pages are interleaved by the allocator whichever thread writes them first, so the cells
+    // are constructed on the pool just to be quicker
     m_data.resize( m_count );
+    STerraData *pData = m_data.data();
+    pPool->ParallelFor( m_count, [ pData ]( const int begin, const int end )
+    {
+        for( int i = begin; i < end; ++i )
+            ::new( (void*)( pData + i ) ) STerraData();
+    } );
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void CTerraData::Check()
 {
+    // Land and water come from valid temperatures, so a cell may be both or none of them
     const int cellCount = static_cast< int >( m_data.size() );
+    int landCount = 0;
+    int waterCount = 0;
+    int bothCount = 0;
+    int emptyCount = 0;
     for( int i = 0; i < cellCount; ++i )
     {
         const STerraData& data = m_data[i];
-        const bool bIsLandAndSea = data.bIsLand && data.bIsWater;
-        assert( data.bIsInit );
-        assert( bIsLandAndSea ); // Cool!
+        assert( data.bIsInit == ( data.bIsLand || data.bIsWater ) );
+        if( data.bIsLand && data.bIsWater )
+            ++bothCount;
+        else if( data.bIsLand )
+            ++landCount;
+        else if( data.bIsWater )
+            ++waterCount;
+        else
+            ++emptyCount;
+    }
+    
+    printf( "\nCells: %d land, %d water, %d both, %d without temperatures\n", landCount, waterCount, bothCount, emptyCount );
+    printf( "Valid cells of fields:\n" );
+    printf( "\theight    : %5.1f%%\n", 100.0 * GetValidCount( TERRA_FIELD_HEIGHT ) / cellCount );
+    printf( "\tpopulation: %5.1f%%\n", 100.0 * GetValidCount( TERRA_FIELD_POPULATION ) / cellCount );
+    const char *pTempName[3] = { "day", "night", "sea" };
+    for( int t = 0; t < 3; ++t )
+    {
+        printf( "\t%-10s:", pTempName[t] );
+        for( int month = 0; month < 12; ++month )
+            printf( " %5.1f", 100.0 * GetValidCount( TERRA_FIELD_TEMP_DAY + t * 12 + month ) / cellCount );
+        printf( "\n" );
     }
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -45,12 +108,65 @@ void CTerraData::CreateSnapShot( const int id )
 
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void CTerraData::Load( const char *pFilename  )
+bool CTerraData::Load( const char *pFilename  )
 {
+    std::ifstream file;
+    file.open( pFilename, std::ios::in | std::ios::binary );
+    if( !file.is_open() )
+        return false;
+    
+    printf( "\nLoading geoid data from %s...\n", pFilename );
+    
+    const int cellCount = ReadInt( file );
+    if( file.fail() || cellCount != m_count )
+    {
+        std::cout << "\tGeoid data has other cell count" << std::endl;
+        return false;
+    }
+    
+    // Cells are stored as in Save: coordinates, height, population and 12 months of temperatures
+    const int cellFloatCount = 4 + 12 * 3;
+    std::vector< float > cellValue( static_cast< size_t >( cellCount ) * cellFloatCount );
+    file.read( (char*)cellValue.data(), sizeof( float ) * cellValue.size() );
+    if( file.fail() )
+    {
+        std::cout << "\tGeoid data is truncated" << std::endl;
+        return false;
+    }
+    
+    // Coordinates must be of the current geometry. Flags are not stored. Cells are checked
+    // before any is changed and written in place, so their pages stay where they were placed.
+    for( int i = 0; i < cellCount; ++i )
+    {
+        const float *pValue = &cellValue[static_cast< size_t >( i ) * cellFloatCount];
+        if( pValue[0] != m_data[i].angleLat || pValue[1] != m_data[i].angleLon )
+        {
+            std::cout << "\tGeoid data has other geometry" << std::endl;
+            return false;
+        }
+    }
+    
+    for( int i = 0; i < cellCount; ++i )
+    {
+        const float *pValue = &cellValue[static_cast< size_t >( i ) * cellFloatCount];
+        STerraData& cell = m_data[i];
+        cell.height = pValue[2];
+        cell.population = pValue[3];
+        for( int j = 0; j < 12; ++j )
+        {
+            cell.landTempDay[j] = pValue[4 + j * 3];
+            cell.landTempNight[j] = pValue[4 + j * 3 + 1];
+            cell.seaTemp[j] = pValue[4 + j * 3 + 2];
+        }
+    }
+    
+    printf( "\tLoading geoid data completed.\n" );
+    return true;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void CTerraData::Save( const char *pFilename  )
 {
+    CProfileScope scope( "SaveTerraData", pFilename );
     printf( "\nSaving geoid data to %s...\n", pFilename );
     
     const int cellCount = static_cast< int >( m_data.size() );
@@ -86,6 +202,40 @@ void CTerraData::Save( const char *pFilename  )
     printf( "\tSaving geoid data completed.\n");
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CTerraData::LoadValidity( const char *pFilename )
+{
+    std::ifstream file;
+    file.open( pFilename, std::ios::in | std::ios::binary );
+    if( !file.is_open() )
+        return false;
+    
+    // Cell count, field count and the masks of all fields
+    const int cellCount = ReadInt( file );
+    const int fieldCount = ReadInt( file );
+    TMaskVec validMask( m_validMask.size() );
+    file.read( (char*)validMask.data(), sizeof( uint64_t ) * validMask.size() );
+    if( file.fail() || cellCount != m_count || fieldCount != TERRA_FIELD_COUNT )
+    {
+        std::cout << "\tValidity of geoid data doesn't match: " << pFilename << std::endl;
+        return false;
+    }
+    
+    m_validMask.swap( validMask );
+    return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CTerraData::SaveValidity( const char *pFilename )
+{
+    std::ofstream file;
+    file.open( pFilename, std::ios::out | std::ios::binary );
+    
+    const int fieldCount = TERRA_FIELD_COUNT;
+    file.write( (char*)&m_count, sizeof( int ) );
+    file.write( (char*)&fieldCount, sizeof( int ) );
+    file.write( (char*)m_validMask.data(), sizeof( uint64_t ) * m_validMask.size() );
+    file.close();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 int CTerraData::GetCount() const
 {
     assert( m_count == static_cast< int >( m_data.size() ) );
@@ -99,3 +249,122 @@ STerraData& CTerraData::GetData( const int id )
     return m_data[id];
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t *CTerraData::GetValidMask( const int field )
+{
+    assert( field >= 0 && field < TERRA_FIELD_COUNT );
+    return m_validMask.data() + static_cast< size_t >( field ) * m_wordCount;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CTerraData::IsValid( const int field, const int id ) const
+{
+    assert( field >= 0 && field < TERRA_FIELD_COUNT );
+    assert( id >= 0 && id < m_count );
+    const uint64_t word = m_validMask[static_cast< size_t >( field ) * m_wordCount + ( id >> 6 )];
+    return ( word >> ( id & 63 ) ) & 1;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CTerraData::GetValidCount( const int field ) const
+{
+    assert( field >= 0 && field < TERRA_FIELD_COUNT );
+    const uint64_t *pWord = m_validMask.data() + static_cast< size_t >( field ) * m_wordCount;
+    int count = 0;
+    for( int w = 0; w < m_wordCount; ++w )
+        count += static_cast< int >( std::bitset< 64 >( pWord[w] ).count() );
+    return count;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CTerraData::ResetFields( const std::vector< bool >& bIsReset )
+{
+    // Values of all fields are cleared in one pass over the cells
+    assert( static_cast< int >( bIsReset.size() ) == TERRA_FIELD_COUNT );
+    std::vector< int > field;
+    for( int f = 0; f < TERRA_FIELD_COUNT; ++f )
+        if( bIsReset[f] )
+        {
+            field.push_back( f );
+            memset( GetValidMask( f ), 0, sizeof( uint64_t ) * m_wordCount );
+        }
+    if( field.empty() )
+        return;
+    
+    const int fieldCount = static_cast< int >( field.size() );
+    for( int i = 0; i < m_count; ++i )
+        for( int f = 0; f < fieldCount; ++f )
+            m_data[i].GetField( field[f] ) = 0.0f;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CTerraData::UpdateFlags()
+{
+    // Land has a valid day or night temperature of any month, water has a valid sea one
+    for( int w = 0; w < m_wordCount; ++w )
+    {
+        uint64_t landWord = 0;
+        uint64_t waterWord = 0;
+        for( int month = 0; month < 12; ++month )
+        {
+            landWord |= GetValidMask( TERRA_FIELD_TEMP_DAY + month )[w];
+            landWord |= GetValidMask( TERRA_FIELD_TEMP_NIGHT + month )[w];
+            waterWord |= GetValidMask( TERRA_FIELD_TEMP_SEA + month )[w];
+        }
+        
+        const int end = std::min( m_count, ( w + 1 ) * 64 );
+        for( int i = w * 64; i < end; ++i )
+        {
+            STerraData& data = m_data[i];
+            data.bIsLand = ( landWord >> ( i & 63 ) ) & 1;
+            data.bIsWater = ( waterWord >> ( i & 63 ) ) & 1;
+            data.bIsInit = data.bIsLand || data.bIsWater;
+        }
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void ReportRangeNodes( const char *pName, const void *pData, const size_t size )
+{
+    // Asks the kernel which node holds every page of the range, nothing is moved
+#ifdef __linux__
+    const size_t pageSize = static_cast< size_t >( sysconf( _SC_PAGESIZE ) );
+    const uintptr_t begin = reinterpret_cast< uintptr_t >( pData ) & ~( pageSize - 1 );
+    const uintptr_t end = reinterpret_cast< uintptr_t >( pData ) + size;
+    const size_t pageCount = ( end - begin + pageSize - 1 ) / pageSize;
+    std::vector< void* > page( pageCount );
+    std::vector< int > status( pageCount, -1 );
+    for( size_t i = 0; i < pageCount; ++i )
+        page[i] = reinterpret_cast< void* >( begin + i * pageSize );
+    if( syscall( __NR_move_pages, 0, pageCount, page.data(), nullptr, status.data(), 0 ) != 0 )
+    {
+        printf( "\n%s pages by NUMA node are unavailable\n", pName );
+        return;
+    }
+    
+    std::vector< size_t > nodePageCount;
+    size_t unknownCount = 0;
+    for( size_t i = 0; i < pageCount; ++i )
+    {
+        if( status[i] < 0 )
+        {
+            ++unknownCount;
+            continue;
+        }
+        if( static_cast< size_t >( status[i] ) >= nodePageCount.size() )
+            nodePageCount.resize( status[i] + 1, 0 );
+        ++nodePageCount[status[i]];
+    }
+    
+    printf( "\n%s pages by NUMA node (%d page(s)):\n", pName, (int)pageCount );
+    for( size_t i = 0; i < nodePageCount.size(); ++i )
+        printf( "\tnode %d: %5.1f%%\n", (int)i, 100.0 * nodePageCount[i] / pageCount );
+    if( unknownCount > 0 )
+        printf( "\tnot placed: %5.1f%%\n", 100.0 * unknownCount / pageCount );
+#else
+    (void)pData;
+    (void)size;
+    printf( "\n%s pages by NUMA node are reported on Linux only\n", pName );
+#endif
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CTerraData::ReportPageNodes() const
+{
+    ReportRangeNodes( "Cell", m_data.data(), sizeof( STerraData ) * m_data.size() );
+    ReportRangeNodes( "Validity", m_validMask.data(), sizeof( uint64_t ) * m_validMask.size() );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -12,12 +12,31 @@
 #pragma once
 #include <cstdint>
 #include <vector>
+#include <memory>
+#include <new>
+#include <utility>
 
+#include "Utils.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Fields written by items, temperatures have one field per month. One item writes one field,
+// several items may write the same.
+enum ETerraField
+{
+    TERRA_FIELD_HEIGHT,
+    TERRA_FIELD_POPULATION,
+    TERRA_FIELD_TEMP_DAY,
+    TERRA_FIELD_TEMP_NIGHT = TERRA_FIELD_TEMP_DAY + 12,
+    TERRA_FIELD_TEMP_SEA = TERRA_FIELD_TEMP_NIGHT + 12,
+    TERRA_FIELD_COUNT = TERRA_FIELD_TEMP_SEA + 12
+};
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 struct STerraData
 {
     STerraData();
     
+    float&  GetField( const int field );
+    
     // Coordinates
     float   angleLat;
     float   angleLon;
@@ -31,32 +50,74 @@ struct STerraData
     float   landTempNight[12];
     float   seaTemp[12];
     
-    // Flags
+    // Flags, set by UpdateFlags from the validity of temperatures
     bool    bIsLand;
     bool    bIsWater;
     bool    bIsInit;
 };
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+class CThreadPool;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Interleaved allocator which leaves default constructed elements untouched, so a vector is
+// resized at once and its elements are constructed later, in parallel
+template< typename T >
+class TDeferredInitAllocator : public TInterleavedAllocator< T >
+{
+public:
+    template< typename U >
+    struct rebind
+    {
+        typedef TDeferredInitAllocator< U > other;
+    };
+    
+    TDeferredInitAllocator() {}
+    template< typename U >
+    TDeferredInitAllocator( const TDeferredInitAllocator< U >& ) {}
+    
+    template< typename U >
+    void construct( U *pObject ) { (void)pObject; }
+    template< typename U, typename... TArgs >
+    void construct( U *pObject, TArgs&&... args ) { ::new( (void*)pObject ) U( std::forward< TArgs >( args )... ); }
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
 class CTerraData
 {
 public:
-    CTerraData( const int count );
+    // Pages of cells and validity words are interleaved over all NUMA nodes, sample jobs of any
+    // worker read them at the same mean distance. Cells are constructed on the pool.
+    CTerraData( const int count, CThreadPool *pPool );
     void        Check();
     void        CreateSnapShot( const int id );
-    void        Load( const char *pFilename  );
+    bool        Load( const char *pFilename  );
     void        Save( const char *pFilename  );
+    bool        LoadValidity( const char *pFilename );
+    void        SaveValidity( const char *pFilename );
     
     int         GetCount() const;
     STerraData& GetData( const int id );
+    void        ReportPageNodes() const;
+    
+    // Bit i of word i / 64 is set if cell i got a valid value of the field. Writers of
+    // different cell ranges share no words if the ranges are aligned to 64 cells.
+    uint64_t   *GetValidMask( const int field );
+    bool        IsValid( const int field, const int id ) const;
+    int         GetValidCount( const int field ) const;
+    void        ResetFields( const std::vector< bool >& bIsReset );
+    void        UpdateFlags();
     
     
 private:
         
+    typedef std::vector< STerraData, TDeferredInitAllocator< STerraData > > TDataVec;
+    typedef std::vector< uint64_t, TInterleavedAllocator< uint64_t > > TMaskVec;
+    
     // Declate bu never define to preven copy
     CTerraData( const CTerraData& );
     CTerraData& operator=( const CTerraData& );
     
-    std::vector< STerraData >   m_data;
+    TDataVec                    m_data;
+    TMaskVec                    m_validMask;    // Field f is words [f * m_wordCount, ( f + 1 ) * m_wordCount)
     const int                   m_count;
+    const int                   m_wordCount;
 };
 ////////////////////////////////////////////////////////////////////////////////////////////////////
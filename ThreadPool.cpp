@@ -0,0 +1,123 @@
+#include "ThreadPool.h"
+
+#include <cassert>
+#include <algorithm>
+#include <iostream>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+#include "Profiler.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const int g_rangePerThread = 4;     // Ranges of ParallelFor for every worker, evens out their load
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CThreadPool::CThreadPool( const int threadCount, const bool bIsPinned ) :
+    m_bIsPinned( bIsPinned ),
+    m_bIsStopped( false )
+{
+    assert( threadCount > 0 );
+    m_thread.reserve( threadCount );
+    for( int i = 0; i < threadCount; ++i )
+        m_thread.push_back( std::thread( ThreadWorker, this, i ) );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+CThreadPool::~CThreadPool()
+{
+    {
+        std::lock_guard< std::mutex > lock( m_mutex );
+        m_bIsStopped = true;
+        m_cv.notify_all();
+    }
+    
+    for( size_t i = 0; i < m_thread.size(); ++i )
+        m_thread[i].join();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int CThreadPool::GetThreadCount() const
+{
+    return static_cast< int >( m_thread.size() );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CThreadPool::Submit( const TTask& task )
+{
+    std::lock_guard< std::mutex > lock( m_mutex );
+    assert( !m_bIsStopped );
+    m_task.push_back( task );
+    m_cv.notify_one();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CThreadPool::ParallelFor( const int count, const TRangeTask& task )
+{
+    if( count <= 0 )
+        return;
+    
+    const int rangeCount = std::min( count, GetThreadCount() * g_rangePerThread );
+    std::mutex doneMutex;
+    std::condition_variable doneCV;
+    int rangeLeft = rangeCount;
+    for( int i = 0; i < rangeCount; ++i )
+    {
+        const int begin = static_cast< int >( static_cast< int64_t >( count ) * i / rangeCount );
+        const int end = static_cast< int >( static_cast< int64_t >( count ) * ( i + 1 ) / rangeCount );
+        Submit( [ &task, &doneMutex, &doneCV, &rangeLeft, begin, end ]()
+        {
+            task( begin, end );
+            std::lock_guard< std::mutex > lock( doneMutex );
+            if( --rangeLeft == 0 )
+                doneCV.notify_one();
+        } );
+    }
+    
+    std::unique_lock< std::mutex > lock( doneMutex );
+    while( rangeLeft > 0 )
+        doneCV.wait( lock );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void CThreadPool::ThreadWorker( CThreadPool *pPool, const int id )
+{
+    CProfiler::SetThreadName( "worker", id );
+    if( pPool->m_bIsPinned && !pPool->PinThread( id ) && 0 == id )
+        std::cout << "Can't pin worker threads to cores" << std::endl;
+    
+    for( ; ; )
+    {
+        TTask task;
+        {
+            std::unique_lock< std::mutex > lock( pPool->m_mutex );
+            while( pPool->m_task.empty() && !pPool->m_bIsStopped )
+                pPool->m_cv.wait( lock );
+            if( pPool->m_task.empty() )
+                return;
+            
+            task = std::move( pPool->m_task.front() );
+            pPool->m_task.pop_front();
+        }
+        task();
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool CThreadPool::PinThread( const int id )
+{
+    const int coreCount = std::max( 1, static_cast< int >( std::thread::hardware_concurrency() ) );
+#if defined( __linux__ )
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( id % coreCount, &set );
+    return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+#elif defined( __APPLE__ )
+    // There is no hard affinity, different tags ask the kernel to keep workers apart
+    thread_affinity_policy_data_t policy = { id % coreCount + 1 };
+    return thread_policy_set( mach_thread_self(), THREAD_AFFINITY_POLICY, (thread_policy_t)&policy,
+                              THREAD_AFFINITY_POLICY_COUNT ) == KERN_SUCCESS;
+#else
+    return false;
+#endif
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
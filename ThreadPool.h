@@ -0,0 +1,53 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  ThreadPool.h
+//  GeoData
+//
+//  Class CThreadPool: process-wide workers running tasks in the order of submitting
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// One queue for all workers, so a task starts only after all tasks submitted before it have
+// started. Tasks may wait for tasks submitted earlier, never for later ones. Workers may be
+// pinned to cores: worker i runs on core i modulo the core count.
+class CThreadPool
+{
+public:
+    typedef std::function< void() > TTask;
+    typedef std::function< void( const int begin, const int end ) > TRangeTask;
+    
+    CThreadPool( const int threadCount, const bool bIsPinned );
+    ~CThreadPool();
+    
+    int         GetThreadCount() const;
+    void        Submit( const TTask& task );
+    
+    // Splits [0, count) into ranges, runs them on the workers and returns when all are done.
+    // Must not be called from a task.
+    void        ParallelFor( const int count, const TRangeTask& task );
+
+private:
+    
+    // Declate bu never define to preven copy
+    CThreadPool( const CThreadPool& );
+    CThreadPool& operator=( const CThreadPool& );
+    
+    static void ThreadWorker( CThreadPool *pPool, const int id );
+    bool        PinThread( const int id );
+    
+    std::mutex                  m_mutex;
+    std::condition_variable     m_cv;
+    std::deque< TTask >         m_task;
+    std::vector< std::thread >  m_thread;
+    const bool                  m_bIsPinned;
+    bool                        m_bIsStopped;
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
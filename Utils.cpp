@@ -4,6 +4,20 @@
 #include <iostream>
 #include <cassert>
 #include <memory>
+#include <cstring>
+#include <vector>
+#include <new>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const size_t g_interleaveMinSize = 1 << 20;  // Smaller blocks come from the heap
+static const int    g_maxNodeCount = 1024;          // Bits of the node mask
+static const int    g_mpolInterleave = 3;           // MPOL_INTERLEAVE of linux/mempolicy.h
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 struct SFloat24
@@ -106,3 +120,111 @@ int ReadInt24( std::ifstream& file )
     return value.val;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+// FNV-1a over 64-bit words of the file content. Returns 0 if the file can't be read.
+uint64_t CalcFileHash( const char *pFilename )
+{
+    std::ifstream file;
+    file.open( pFilename, std::ios::in | std::ios::binary );
+    if( !file.is_open() )
+        return 0;
+    
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const size_t bufferSize = 1 << 20;
+    std::unique_ptr< uint64_t[] > pBuffer( new uint64_t[bufferSize / sizeof( uint64_t )] );
+    uint64_t byteCount = 0;
+    while( file )
+    {
+        file.read( (char*)pBuffer.get(), bufferSize );
+        const size_t readSize = static_cast< size_t >( file.gcount() );
+        if( 0 == readSize )
+            break;
+        
+        // Zero the tail of the last word, the total size is mixed in below
+        const size_t wordCount = ( readSize + sizeof( uint64_t ) - 1 ) / sizeof( uint64_t );
+        memset( (char*)pBuffer.get() + readSize, 0, wordCount * sizeof( uint64_t ) - readSize );
+        for( size_t i = 0; i < wordCount; ++i )
+            hash = ( hash ^ pBuffer[i] ) * prime;
+        byteCount += readSize;
+    }
+    
+    return ( hash ^ byteCount ) * prime;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifdef __linux__
+// Mask of online nodes, the list looks like "0-3,8". Empty if it can't be read.
+static std::vector< unsigned long > ReadOnlineNodeMask()
+{
+    const int bitCount = sizeof( unsigned long ) * 8;
+    std::vector< unsigned long > mask;
+    std::ifstream file( "/sys/devices/system/node/online" );
+    int first = 0;
+    while( file >> first )
+    {
+        int last = first;
+        if( file.peek() == '-' )
+        {
+            file.get();
+            file >> last;
+        }
+        if( file.peek() == ',' )
+            file.get();
+        
+        for( int node = first; node <= last && node >= 0 && node < g_maxNodeCount; ++node )
+        {
+            if( static_cast< size_t >( node / bitCount ) >= mask.size() )
+                mask.resize( node / bitCount + 1, 0 );
+            mask[node / bitCount] |= 1UL << ( node % bitCount );
+        }
+    }
+    return mask;
+}
+#endif
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sets interleaved policy of the page aligned range, pages touched before keep their nodes.
+// Returns false if the policy can't be set or on other systems than Linux.
+bool InterleavePages( void *pData, const size_t size )
+{
+#ifdef __linux__
+    static const std::vector< unsigned long > nodeMask = ReadOnlineNodeMask();
+    if( nodeMask.empty() )
+        return false;
+    
+    // The kernel takes one bit less than passed
+    const unsigned long maxNode = nodeMask.size() * sizeof( unsigned long ) * 8 + 1;
+    return 0 == syscall( __NR_mbind, pData, size, g_mpolInterleave, nodeMask.data(), maxNode, 0 );
+#else
+    (void)pData;
+    (void)size;
+    return false;
+#endif
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void *AllocInterleaved( const size_t size )
+{
+    // Big blocks are mapped, so they start at a page and their pages aren't touched yet
+#ifdef __linux__
+    if( size >= g_interleaveMinSize )
+    {
+        void *pData = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( MAP_FAILED == pData )
+            throw std::bad_alloc();
+        InterleavePages( pData, size );
+        return pData;
+    }
+#endif
+    return ::operator new( size );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void FreeInterleaved( void *pData, const size_t size )
+{
+#ifdef __linux__
+    if( size >= g_interleaveMinSize )
+    {
+        munmap( pData, size );
+        return;
+    }
+#endif
+    ::operator delete( pData );
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
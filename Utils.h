@@ -14,4 +14,29 @@ void        SaveInt24( std::ofstream& file, const int val );
 int         ReadInt( std::ifstream& file );
 float       ReadFlt( std::ifstream& file );
 int         ReadInt24( std::ifstream& file );
+uint64_t    CalcFileHash( const char *pFilename );
+bool        InterleavePages( void *pData, const size_t size );
+void       *AllocInterleaved( const size_t size );
+void        FreeInterleaved( void *pData, const size_t size );
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocator of blocks whose pages are spread round-robin over all NUMA nodes whichever thread
+// touches them first. Suits big arrays written by one thread and read by all workers.
+template< typename T >
+class TInterleavedAllocator
+{
+public:
+    typedef T value_type;
+    
+    TInterleavedAllocator() {}
+    template< typename U >
+    TInterleavedAllocator( const TInterleavedAllocator< U >& ) {}
+    
+    T          *allocate( const size_t n ) { return static_cast< T* >( AllocInterleaved( n * sizeof( T ) ) ); }
+    void        deallocate( T *pData, const size_t n ) { FreeInterleaved( pData, n * sizeof( T ) ); }
+};
+////////////////////////////////////////////////////////////////////////////////////////////////////
+template< typename T, typename U >
+bool operator==( const TInterleavedAllocator< T >&, const TInterleavedAllocator< U >& ) { return true; }
+template< typename T, typename U >
+bool operator!=( const TInterleavedAllocator< T >&, const TInterleavedAllocator< U >& ) { return false; }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -332,6 +332,57 @@ void idct_4x4(const jpgd_block_t* pSrc_ptr, uint8* pDst_ptr)
   }
 }
 
+// Reduced IDCT basis for scaled decoding: FIX(C(u) * cos((2x + 1) * u * PI / 2N) / 2) with 12 fraction bits,
+// indexed [x * N + u]. Only the top-left NxN coefficients of the block are used, so the N-point inverse
+// transform reconstructs the block downscaled by 8/N.
+static const int s_idct_scaled_4[16] = { 1448, 1892, 1448, 784, 1448, 784, -1448, -1892, 1448, -784, -1448, 1892, 1448, -1892, 1448, -784 };
+static const int s_idct_scaled_2[4] = { 1448, 1448, 1448, -1448 };
+
+// Writes (8 >> scale_shift)^2 pixels to the top-left corner of the 8x8 destination block.
+void idct_scaled(const jpgd_block_t* pSrc_ptr, uint8* pDst_ptr, int block_max_zag, int scale_shift)
+{
+  JPGD_ASSERT((scale_shift >= 1) && (scale_shift <= 3));
+
+  if ((scale_shift == 3) || (block_max_zag <= 1))
+  {
+    const int size = 8 >> scale_shift;
+    int k = ((pSrc_ptr[0] + 4) >> 3) + 128;
+    k = CLAMP(k);
+
+    for (int y = 0; y < size; y++)
+      for (int x = 0; x < size; x++)
+        pDst_ptr[y * 8 + x] = static_cast<uint8>(k);
+    return;
+  }
+
+  const int size = 8 >> scale_shift;
+  const int* pTab = (scale_shift == 1) ? s_idct_scaled_4 : s_idct_scaled_2;
+  int temp[16];
+
+  for (int v = 0; v < size; v++)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      int sum = 0;
+      for (int u = 0; u < size; u++)
+        sum += pTab[x * size + u] * pSrc_ptr[v * 8 + u];
+      temp[v * size + x] = DESCALE(sum, 9);
+    }
+  }
+
+  for (int y = 0; y < size; y++)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      int sum = 0;
+      for (int v = 0; v < size; v++)
+        sum += pTab[y * size + v] * temp[v * size + x];
+      int k = DESCALE_ZEROSHIFT(sum, 15);
+      pDst_ptr[y * 8 + x] = static_cast<uint8>(CLAMP(k));
+    }
+  }
+}
+
 // Retrieve one character from the input stream.
 inline uint jpeg_decoder::get_char()
 {
@@ -1387,6 +1438,9 @@ void jpeg_decoder::init(jpeg_decoder_stream *pStream)
   m_successive_high = 0;
   m_max_mcu_x_size = 0;
   m_max_mcu_y_size = 0;
+  m_scale_shift = 0;
+  m_out_mcu_x_size = 0;
+  m_out_mcu_y_size = 0;
   m_blocks_per_mcu = 0;
   m_max_blocks_per_row = 0;
   m_mcus_per_row = 0;
@@ -1499,7 +1553,10 @@ void jpeg_decoder::transform_mcu(int mcu_row)
 
   for (int mcu_block = 0; mcu_block < m_blocks_per_mcu; mcu_block++)
   {
-    idct(pSrc_ptr, pDst_ptr, m_mcu_block_max_zag[mcu_block]);
+    if (m_scale_shift)
+      idct_scaled(pSrc_ptr, pDst_ptr, m_mcu_block_max_zag[mcu_block], m_scale_shift);
+    else
+      idct(pSrc_ptr, pDst_ptr, m_mcu_block_max_zag[mcu_block]);
     pSrc_ptr += 64;
     pDst_ptr += 64;
   }
@@ -2101,6 +2158,49 @@ void jpeg_decoder::expanded_convert()
   }
 }
 
+// Any subsampling, blocks reconstructed by idct_scaled(): every block holds (8 >> m_scale_shift)^2 pixels in
+// its top-left corner. Chroma is upsampled by nearest neighbor.
+void jpeg_decoder::scaled_convert()
+{
+  const int row = m_out_mcu_y_size - m_mcu_lines_left;
+  const int block_size = 8 >> m_scale_shift;
+  const int h_samp = m_comp_h_samp[0];
+  const int v_samp = m_comp_v_samp[0];
+
+  const uint8* pY = m_pSample_buf + (row / block_size) * h_samp * 64 + (row % block_size) * 8;
+  const uint8* pC = m_pSample_buf + h_samp * v_samp * 64 + (row / v_samp) * 8;
+
+  uint8* d = m_pScan_line_0;
+
+  for (int i = m_max_mcus_per_row; i > 0; i--)
+  {
+    if (m_scan_type == JPGD_GRAYSCALE)
+    {
+      for (int j = 0; j < block_size; j++)
+        *d++ = pY[j];
+    }
+    else
+    {
+      for (int x = 0; x < m_out_mcu_x_size; x++)
+      {
+        int y = pY[(x / block_size) * 64 + (x % block_size)];
+        int cb = pC[x / h_samp];
+        int cr = pC[64 + x / h_samp];
+
+        d[0] = clamp(y + m_crr[cr]);
+        d[1] = clamp(y + ((m_crg[cr] + m_cbg[cb]) >> 16));
+        d[2] = clamp(y + m_cbb[cb]);
+        d[3] = 255;
+
+        d += 4;
+      }
+    }
+
+    pY += 64 * m_blocks_per_mcu;
+    pC += 64 * m_blocks_per_mcu;
+  }
+}
+
 // Find end of image (EOI) marker, so we can return to the user the exact size of the input stream.
 void jpeg_decoder::find_eoi()
 {
@@ -2140,13 +2240,18 @@ int jpeg_decoder::decode(const void** pScan_line, uint* pScan_line_len)
       decode_next_row();
 
     // Find the EOI marker if that was the last row.
-    if (m_total_lines_left <= m_max_mcu_y_size)
+    if (m_total_lines_left <= m_out_mcu_y_size)
       find_eoi();
 
-    m_mcu_lines_left = m_max_mcu_y_size;
+    m_mcu_lines_left = m_out_mcu_y_size;
   }
 
-  if (m_freq_domain_chroma_upsample)
+  if (m_scale_shift)
+  {
+    scaled_convert();
+    *pScan_line = m_pScan_line_0;
+  }
+  else if (m_freq_domain_chroma_upsample)
   {
     expanded_convert();
     *pScan_line = m_pScan_line_0;
@@ -2529,9 +2634,16 @@ void jpeg_decoder::init_frame()
   else
     m_dest_bytes_per_pixel = 4;
 
-  m_dest_bytes_per_scan_line = ((m_image_x_size + 15) & 0xFFF0) * m_dest_bytes_per_pixel;
+  m_out_mcu_x_size = m_max_mcu_x_size >> m_scale_shift;
+  m_out_mcu_y_size = m_max_mcu_y_size >> m_scale_shift;
 
-  m_real_dest_bytes_per_scan_line = (m_image_x_size * m_dest_bytes_per_pixel);
+  // Scaled conversion writes whole MCUs, so the buffer has to hold every MCU of the row.
+  if (m_scale_shift)
+    m_dest_bytes_per_scan_line = m_max_mcus_per_row * m_out_mcu_x_size * m_dest_bytes_per_pixel;
+  else
+    m_dest_bytes_per_scan_line = ((m_image_x_size + 15) & 0xFFF0) * m_dest_bytes_per_pixel;
+
+  m_real_dest_bytes_per_scan_line = (get_width() * m_dest_bytes_per_pixel);
 
   // Initialize two scan line buffers.
   m_pScan_line_0 = (uint8 *)alloc(m_dest_bytes_per_scan_line, true);
@@ -2556,7 +2668,7 @@ void jpeg_decoder::init_frame()
 	// Freq. domain chroma upsampling is only supported for H2V2 subsampling factor (the most common one I've seen).
   m_freq_domain_chroma_upsample = false;
 #if JPGD_SUPPORT_FREQ_DOMAIN_UPSAMPLING
-  m_freq_domain_chroma_upsample = (m_expanded_blocks_per_mcu == 4*3);
+  m_freq_domain_chroma_upsample = (m_expanded_blocks_per_mcu == 4*3) && (m_scale_shift == 0);
 #endif
 
   if (m_freq_domain_chroma_upsample)
@@ -2564,7 +2676,7 @@ void jpeg_decoder::init_frame()
   else
     m_pSample_buf = (uint8 *)alloc(m_max_blocks_per_row * 64);
 
-  m_total_lines_left = m_image_y_size;
+  m_total_lines_left = get_height();
 
   m_mcu_lines_left = 0;
 
@@ -2952,6 +3064,15 @@ int jpeg_decoder::begin_decoding()
   return JPGD_SUCCESS;
 }
 
+bool jpeg_decoder::set_scale_shift(int scale_shift)
+{
+  if ((m_ready_flag) || (scale_shift < 0) || (scale_shift > 3))
+    return false;
+
+  m_scale_shift = scale_shift;
+  return true;
+}
+
 jpeg_decoder::~jpeg_decoder()
 {
   free_all_blocks();
@@ -3169,4 +3290,4 @@ unsigned char *decompress_jpeg_image_from_file(const char *pSrc_filename, int *w
   return decompress_jpeg_image_from_stream(&file_stream, width, height, actual_comps, req_comps);
 }
 
-} // namespace jpgd
\ No newline at end of file
+} // namespace jpgd
\ No newline at end of file
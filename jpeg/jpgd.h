@@ -128,6 +128,11 @@ namespace jpgd
     // If JPGD_SUCCESS is returned you may then call decode() on each scanline.
     int begin_decoding();
 
+    // Optionally call this method before begin_decoding() to decode a downscaled image: every 8x8 block is
+    // reconstructed by a reduced IDCT to 4x4, 2x2 or 1x1 pixels (scale_shift 1, 2 or 3). get_width()/get_height()
+    // then return the scaled size. Returns false if decoding has already begun or scale_shift is out of range.
+    bool set_scale_shift(int scale_shift);
+
     // Returns the next scan line.
     // For grayscale images, pScan_line will point to a buffer containing 8-bit pixels (get_bytes_per_pixel() will return 1). 
     // Otherwise, it will always point to a buffer containing 32-bit RGBA pixels (A will always be 255, and get_bytes_per_pixel() will return 4).
@@ -138,13 +143,15 @@ namespace jpgd
     
     inline jpgd_status get_error_code() const { return m_error_code; }
 
-    inline int get_width() const { return m_image_x_size; }
-    inline int get_height() const { return m_image_y_size; }
+    inline int get_width() const { return (m_image_x_size + (1 << m_scale_shift) - 1) >> m_scale_shift; }
+    inline int get_height() const { return (m_image_y_size + (1 << m_scale_shift) - 1) >> m_scale_shift; }
+    inline int get_scale_shift() const { return m_scale_shift; }
 
     inline int get_num_components() const { return m_comps_in_frame; }
+    inline bool is_progressive() const { return m_progressive_flag != 0; }
 
     inline int get_bytes_per_pixel() const { return m_dest_bytes_per_pixel; }
-    inline int get_bytes_per_scan_line() const { return m_image_x_size * get_bytes_per_pixel(); }
+    inline int get_bytes_per_scan_line() const { return get_width() * get_bytes_per_pixel(); }
 
     // Returns the total number of bytes actually consumed by the decoder (which should equal the actual size of the JPEG file).
     inline int get_total_bytes_read() const { return m_total_bytes_read; }
@@ -208,6 +215,9 @@ namespace jpgd
     int m_successive_high;                        // successive approximation high
     int m_max_mcu_x_size;                         // MCU's max. X size in pixels
     int m_max_mcu_y_size;                         // MCU's max. Y size in pixels
+    int m_scale_shift;                            // output is downscaled by 1 << m_scale_shift
+    int m_out_mcu_x_size;                         // MCU's X size in output (scaled) pixels
+    int m_out_mcu_y_size;                         // MCU's Y size in output (scaled) pixels
     int m_blocks_per_mcu;
     int m_max_blocks_per_row;
     int m_mcus_per_row, m_mcus_per_col;
@@ -298,6 +308,7 @@ namespace jpgd
     void H1V1Convert();
     void gray_convert();
     void expanded_convert();
+    void scaled_convert();
     void find_eoi();
     inline uint get_char();
     inline uint get_char(bool *pPadding_flag);
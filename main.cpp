@@ -10,6 +10,8 @@
 #include <iostream>
 #include <cassert>
 #include <thread>
+#include <chrono>
+#include <algorithm>
 #include <cmath>
 
 #include <set>
@@ -17,43 +19,54 @@
 #include "TerraData.h"
 #include "DataCollector.h"
 #include "GeometryData.h"
+#include "Icosphere.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
+#include "PerfCounters.h"
 #include "Utils.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 static const size_t g_memorySize = 256 << 20;
+static const uint64_t g_rasterCacheSize = 4ULL << 30;
+static const char *g_pRasterCacheDir = "RasterCache";
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Vertex, edge and triangle count of one base triangle split n times
+static constexpr int GetPatchVertCount( const int n ) { return ( ( 1 << n ) + 1 ) * ( ( 1 << n ) + 2 ) / 2; }
+static constexpr int GetPatchEdgeCount( const int n ) { return 3 * ( 1 << n ) * ( ( 1 << n ) + 1 ) / 2; }
+static constexpr int GetPatchTriaCount( const int n ) { return 1 << ( 2 * n ); }
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static constexpr int CalcLimitedPartition( const int maxVertCount )
+{
+    int n = 0;
+    while( GetPatchVertCount( n + 1 ) <= maxVertCount )
+        ++n;
+    return n;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static constexpr int g_limitedPartition = CalcLimitedPartition( 65536 );
+static_assert( g_limitedPartition == 8, "Unexpected limited partition" );
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 static int GetLimitedPartition()
 {
-    int countV = 3;
-    int countT = 1;
-    int countE = 3;
-    int n = -1;
-    int patchHierarchyTrianglesCount = 0;
-    while( countV <= 65536 )
+    for( int n = 0; n <= g_limitedPartition; ++n )
     {
-        ++n;
-        patchHierarchyTrianglesCount += countT;
-        const int totalTriaCount = countT;
+        const int totalTriaCount = GetPatchTriaCount( n );
         const int textureSizeA = static_cast< int >( sqrt( (double)totalTriaCount ) );
         assert( textureSizeA * textureSizeA >= totalTriaCount );
          
         printf( "[%d] Vertex: %5d. Triangles: %5d/%7d. Edges: %5d. Texture: %d. \n",
             n,
-            countV,
-            countT,
+            GetPatchVertCount( n ),
+            GetPatchTriaCount( n ),
             totalTriaCount * 20,
-            countE,
+            GetPatchEdgeCount( n ),
             textureSizeA );
-            
-        countV = countV + countE;
-        countE = countE * 2 + countT * 3;
-        countT *= 4;
     }
     
-    return n;
+    return g_limitedPartition;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static void CreateGeometryData()
+static void CreateGeometryData( CThreadPool *pPool )
 {
     std::cout << "Create geometry data..." << std::endl;
     
@@ -67,14 +80,15 @@ static void CreateGeometryData()
     
     for( int i = 0; i < 8; ++i )
     {
-        const uint64_t timeA = GetProcessTime();
+        // Wall time, the split runs on the pool
+        const std::chrono::steady_clock::time_point timeA = std::chrono::steady_clock::now();
         //ico = std::move( SplitIcosahedron( ico ) );
-        ico = SplitIcosahedron( ico );
+        ico = SplitIcosahedron( ico, pPool );
         CheckIcosahedron( ico );
+        CheckIcosphere( ico );
         ReportIcosahedron( ico );
-        const uint64_t timeB = GetProcessTime();
-        const uint64_t timeDelta = timeB - timeA;
-        const int timeDeltaMS = static_cast< int >( timeDelta );
+        const std::chrono::steady_clock::time_point timeB = std::chrono::steady_clock::now();
+        const int timeDeltaMS = static_cast< int >( std::chrono::duration_cast< std::chrono::milliseconds >( timeB - timeA ).count() );
         printf( "\tSplit time: %d ms\n", timeDeltaMS );
     }
     
@@ -84,9 +98,14 @@ static void CreateGeometryData()
     SaveIcosahedronData( ico, "GeoidFace.bin" );
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static void CreateGeoidData( const int coreCount )
+static void CreateGeoidData( CThreadPool *pPool, const int *pStageThreadCount, const size_t memorySize,
+                             const int batchSourceCount )
 {
     const char *pFaceFilename = "GeoidFace.bin";
+    const char *pGeomFilename = "GeoidGeom.bin";
+    const char *pDataFilename = "terraData.bin";
+    const char *pManifestFilename = "terraManifest.xml";
+    const char *pValidityFilename = "terraValid.bin";
     
     // Loading
     std::cout << "Load geometry face data from file: " << pFaceFilename << std::endl;
@@ -101,7 +120,7 @@ static void CreateGeoidData( const int coreCount )
     if( faceCount <= 0 )
         return;
         
-    CTerraData terraData( faceCount );
+    CTerraData terraData( faceCount, pPool );
     for( int i = 0; i < faceCount; ++i )
     {
         STerraData& data = terraData.GetData( i );
@@ -111,21 +130,56 @@ static void CreateGeoidData( const int coreCount )
     file.close();
     std::cout << "Loading completed for " << terraData.GetCount() << " face(s)" << std::endl;
     
+    // Data of the previous run is updated only by items changed since then
+    CDataCollector dataCollector( &terraData, pPool );
+    if( terraData.Load( pDataFilename ) && terraData.LoadValidity( pValidityFilename ) )
+        dataCollector.LoadManifest( pManifestFilename );
+    
     // Load configuration from xml and parse it
-    CDataCollector dataCollector( &terraData, coreCount );
+    dataCollector.SetGeometryFile( pGeomFilename );
+    dataCollector.SetRasterCache( g_pRasterCacheDir, g_rasterCacheSize );
+    dataCollector.SetStageThreadCount( pStageThreadCount[0], pStageThreadCount[1], pStageThreadCount[2] );
+    dataCollector.SetMemoryBudget( memorySize );
+    dataCollector.SetBatchSourceCount( batchSourceCount );
     dataCollector.Collect( "config.xml" );
-    terraData.Save( "terraData.bin" );
+    if( CProfiler::IsEnabled() )
+        terraData.ReportPageNodes();
+    terraData.Save( pDataFilename );
+    terraData.SaveValidity( pValidityFilename );
+    dataCollector.SaveManifest( pManifestFilename );
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 int main( int argc, const char * argv[] )
 {
     const char *pCreateGeomCmd = "-createGeom";
     const char *pCreateDataCmd = "-createData";
+    const char *pStageThreadCmd[3] = { "-readThreads", "-decodeThreads", "-sampleThreads" };
+    const char *pMemoryBudgetCmd = "-memoryBudget";
+    const char *pBatchSourcesCmd = "-batchSources";
+    const char *pThreadsCmd = "-threads";
+    const char *pPinThreadsCmd = "-pinThreads";
+    const char *pTraceCmd = "-trace";
+    const char *pPerfCountersCmd = "-perfCounters";
     
     std::cout << "TerraData" << std::endl;
     
-    const int coreNumber = std::thread::hardware_concurrency();
-    std::cout << "Use " << coreNumber << " core(s) and " << g_memorySize << " byte(s)"<< std::endl;
+    // Memory budget in megabytes, 0 is no limit
+    size_t memorySize = g_memorySize;
+    for( int i = 2; i + 1 < argc; ++i )
+        if( strcmp( argv[i], pMemoryBudgetCmd ) == 0 )
+            memorySize = static_cast< size_t >( atoi( argv[i + 1] ) ) << 20;
+    
+    // Workers of the pool, all cores by default
+    int coreNumber = std::max( 1, static_cast< int >( std::thread::hardware_concurrency() ) );
+    bool bIsPinned = false;
+    for( int i = 2; i < argc; ++i )
+    {
+        if( strcmp( argv[i], pThreadsCmd ) == 0 && i + 1 < argc && atoi( argv[i + 1] ) > 0 )
+            coreNumber = atoi( argv[i + 1] );
+        else if( strcmp( argv[i], pPinThreadsCmd ) == 0 )
+            bIsPinned = true;
+    }
+    std::cout << "Use " << coreNumber << " core(s) and " << memorySize << " byte(s)"<< std::endl;
     
     if( argc < 2 )
     {
@@ -133,14 +187,63 @@ int main( int argc, const char * argv[] )
         std::cout << "Usage:"<< std::endl;
         std::cout << "\t[" << pCreateGeomCmd << "] - Create geometry"<< std::endl;
         std::cout << "\t[" << pCreateDataCmd << "] - Create geoid data"<< std::endl;
+        std::cout << "\t\t[" << pStageThreadCmd[0] << " N] - Tasks reading source files at a time"<< std::endl;
+        std::cout << "\t\t[" << pStageThreadCmd[1] << " N] - Tasks decoding sources at a time"<< std::endl;
+        std::cout << "\t\t[" << pStageThreadCmd[2] << " N] - Tasks writing sampled cells at a time"<< std::endl;
+        std::cout << "\t\t[" << pMemoryBudgetCmd << " MB] - Memory sources may hold at a time, 0 - no limit"<< std::endl;
+        std::cout << "\t\t[" << pBatchSourcesCmd << " N] - Images written by one pass over the cells, 1 - no batches"<< std::endl;
+        std::cout << "\t[" << pThreadsCmd << " N] - Worker threads, all cores by default"<< std::endl;
+        std::cout << "\t[" << pPinThreadsCmd << "] - Pin worker threads to cores"<< std::endl;
+        std::cout << "\t[" << pTraceCmd << " file.json] - Profile and save Chrome trace"<< std::endl;
+        std::cout << "\t[" << pPerfCountersCmd << "] - Profile with hardware counters, Linux only"<< std::endl;
         return 0;
     }
     
+    // Tasks of collection stages running at a time, zero is the default
+    int stageThreadCount[3] = { 0, 0, 0 };
+    for( int i = 2; i + 1 < argc; ++i )
+        for( int stage = 0; stage < 3; ++stage )
+            if( strcmp( argv[i], pStageThreadCmd[stage] ) == 0 )
+                stageThreadCount[stage] = atoi( argv[i + 1] );
+    
+    // Images sampled together, zero is the default
+    int batchSourceCount = 0;
+    for( int i = 2; i + 1 < argc; ++i )
+        if( strcmp( argv[i], pBatchSourcesCmd ) == 0 )
+            batchSourceCount = atoi( argv[i + 1] );
+    
+    // Regions are timed only if a trace or counters are requested
+    const char *pTraceFilename = nullptr;
+    bool bIsPerfCounters = false;
+    for( int i = 2; i < argc; ++i )
+    {
+        if( strcmp( argv[i], pTraceCmd ) == 0 && i + 1 < argc )
+            pTraceFilename = argv[i + 1];
+        else if( strcmp( argv[i], pPerfCountersCmd ) == 0 )
+            bIsPerfCounters = true;
+    }
+    if( pTraceFilename || bIsPerfCounters )
+    {
+        CProfiler::Enable();
+        CProfiler::SetThreadName( "main", -1 );
+    }
+    if( bIsPerfCounters )
+        CPerfCounters::Enable();
+    
+    // One pool runs all the parallel work, so stages never oversubscribe the cores
     const char * const pCommand = argv[1];
-    if( strcmp( pCommand, pCreateGeomCmd ) == 0 )
-        CreateGeometryData();
-    else if( strcmp( pCommand, pCreateDataCmd ) == 0 )
-        CreateGeoidData( coreNumber );
+    {
+        CThreadPool pool( coreNumber, bIsPinned );
+        if( strcmp( pCommand, pCreateGeomCmd ) == 0 )
+            CreateGeometryData( &pool );
+        else if( strcmp( pCommand, pCreateDataCmd ) == 0 )
+            CreateGeoidData( &pool, stageThreadCount, memorySize, batchSourceCount );
+    }
+    
+    if( CProfiler::IsEnabled() )
+        CProfiler::Report();
+    if( pTraceFilename )
+        CProfiler::SaveTrace( pTraceFilename );
         
     std::cout << std::endl << "Completed." << std::endl << std::endl;
         